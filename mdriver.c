@@ -15,6 +15,12 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -73,6 +79,26 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* Blocks one replay thread has handed another to free (see -X) */
+typedef struct {
+    pthread_mutex_t lock;
+    char **ptrs;
+    int n, max;
+} inbox_t;
+
+/* One thread's replay of a trace (see eval_mm_threads) */
+typedef struct replay {
+    trace_t *trace;      /* the trace, shared by every thread */
+    char **blocks;       /* this thread's payload pointers... */
+    int *sizes;          /* ... and their sizes */
+    char id;             /* written to both ends of this thread's payloads */
+    int bad;             /* overwritten payloads */
+    int nomem;           /* requests that got NULL back */
+    struct replay *next; /* with -X, the thread that frees this one's blocks */
+    inbox_t inbox;       /* blocks other threads have left this one to free */
+    pthread_t tid;
+} replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -82,6 +108,9 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double scans;    /* free blocks examined per malloc (-1 for libc) */
+    double rss;      /* resident bytes at the end over the peak (-1 for libc) */
+    double tlb;      /* dTLB load misses in one replay (-1 if not counted) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -91,6 +120,8 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static int count_tlb = 0; /* count dTLB misses in eval_mm (set by -H) */
+static int handoff = 0;   /* -T threads free each other's blocks (set by -X) */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -123,8 +154,16 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss);
 static void eval_mm_speed(void *ptr);
+static void eval_mm(int n, char **tracefiles, stats_t *stats);
+static void sweep_env(const char *var, char *values, int n, char **tracefiles);
+static double dtlb_misses(speed_t *params);
+static void compare_pages(int n, char **tracefiles);
+static void *replay_trace(void *arg);
+static double replay_secs(trace_t *trace, int nthreads);
+static void eval_mm_threads(int nthreads, int n, char **tracefiles);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -140,10 +179,15 @@ int main(int argc, char **argv)
 {
     int i;
     char c;
+    char *orders = NULL;       /* free list orders to compare (set by -p) */
+    char *fits = NULL;         /* placement modes to compare (set by -F) */
+    char *splits = NULL;       /* high end thresholds to compare (set by -S) */
+    char *purges = NULL;       /* purge ages to compare (set by -P) */
+    int huge = 0;              /* compare base and huge pages (set by -H) */
+    int nthreads = 0;          /* threads to replay each trace in (set by -T) */
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
@@ -159,7 +203,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:p:F:S:P:T:r:HXhvVgal")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -180,6 +224,34 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+        case 'r': /* Reserve this many MB of address space for the heap */
+            mem_set_reserve((size_t)atol(optarg) << 20);
+            break;
+        case 'p': /* Compare these free list orders ($MM_ORDER values) */
+            orders = strdup(optarg);
+            break;
+        case 'F': /* Compare these placement modes ($MM_FIT values) */
+            fits = strdup(optarg);
+            break;
+        case 'S': /* Compare these high end thresholds ($MM_SPLIT values) */
+            splits = strdup(optarg);
+            break;
+        case 'P': /* Compare these purge ages ($MM_PURGE values) */
+            purges = strdup(optarg);
+            break;
+        case 'T': /* Replay each trace in this many threads at once */
+            nthreads = atoi(optarg);
+            if (nthreads < 1 || nthreads > 127) {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'H': /* Compare the heap in base pages and in huge pages */
+            huge = 1;
+            break;
+        case 'X': /* With -T, hand every free to the next thread */
+            handoff = 1;
+            break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
@@ -259,6 +331,8 @@ int main(int argc, char **argv)
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
 	    libc_stats[i].valid = eval_libc_valid(trace, i);
+	    libc_stats[i].scans = -1;
+	    libc_stats[i].rss = -1;
 	    if (libc_stats[i].valid) {
 		speed_params.trace = trace;
 		if (verbose > 1)
@@ -275,6 +349,39 @@ int main(int argc, char **argv)
 	}
     }
 
+    /* Initialize the simulated memory system in memlib.c */
+    mem_set_segments(mm_arenas);
+    mem_init(); 
+
+    /*
+     * With -p, -F, -S or -P, run the mm package once per free list
+     * order, placement mode, high end threshold or purge age and print
+     * them side by side instead
+     */
+    if (orders != NULL || fits != NULL || splits != NULL || purges != NULL) {
+	if (orders != NULL)
+	    sweep_env("MM_ORDER", orders, num_tracefiles, tracefiles);
+	if (fits != NULL)
+	    sweep_env("MM_FIT", fits, num_tracefiles, tracefiles);
+	if (splits != NULL)
+	    sweep_env("MM_SPLIT", splits, num_tracefiles, tracefiles);
+	if (purges != NULL)
+	    sweep_env("MM_PURGE", purges, num_tracefiles, tracefiles);
+	exit(0);
+    }
+    if (huge) {
+	compare_pages(num_tracefiles, tracefiles);
+	exit(0);
+    }
+    if (nthreads) {
+	if (!mm_thread_safe) {
+	    printf("ERROR: -T needs a thread safe build, such as mdriver-mt\n");
+	    exit(1);
+	}
+	eval_mm_threads(nthreads, num_tracefiles, tracefiles);
+	exit(0);
+    }
+
     /*
      * Always run and evaluate the student's mm package
      */
@@ -285,29 +392,9 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
-    
-    /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    eval_mm(num_tracefiles, tracefiles, mm_stats);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -397,9 +484,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or within
+       pages that mem_map handed out */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, size)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -705,12 +794,13 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
  *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   package on the trace. The brk can come down again, so memlib
+ *   tracks the high water mark of the heap and mappings itself.
+ *   Also sets *rss to the bytes still resident when the trace ends,
+ *   as a fraction of that high water mark rounded up to whole pages.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss)
 {   
     int i;
     int index;
@@ -719,9 +809,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     int total_size = 0;
     char *p;
     char *newp, *oldp;
+    size_t page;
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package, with none of the
+     * pages earlier runs touched still resident */
     mem_reset_brk();
+    mem_purge(mem_heap_lo(), mem_maxheap());
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
@@ -789,7 +882,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* Mapped pages count too, at the most there were at any time;
+       residency is in whole pages, so round the peak up to them */
+    page = mem_pagesize();
+    *rss = (double)mem_resident() /
+	(double)((mem_peaksize() + page - 1) & ~(page - 1));
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
@@ -925,6 +1023,420 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/*
+ * eval_mm - Check, measure and time the mm package on each trace
+ */
+static void eval_mm(int n, char **tracefiles, stats_t *stats)
+{
+    int i;
+    trace_t *trace;
+    range_t *ranges = NULL;
+    speed_t speed_params;
+
+    for (i=0; i < n; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	stats[i].ops = trace->num_ops;
+	if (verbose > 1)
+	    printf("Checking mm_malloc for correctness, ");
+	stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	if (stats[i].valid) {
+	    if (verbose > 1)
+		printf("efficiency, ");
+	    stats[i].util = eval_mm_util(trace, i, &ranges, &stats[i].rss);
+	    stats[i].scans = mm_mallocs ? (double)mm_scanned / mm_mallocs : 0;
+	    speed_params.trace = trace;
+	    speed_params.ranges = ranges;
+	    if (verbose > 1)
+		printf("and performance.\n");
+	    stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    stats[i].tlb = count_tlb ? dtlb_misses(&speed_params) : -1;
+	}
+	free_trace(trace);
+    }
+    clear_ranges(&ranges);
+}
+
+/*
+ * sweep_env - Evaluate the mm package with the environment variable
+ *     var, which mm_init reads, set to each of the comma separated
+ *     values in turn, and print utilization, throughput, free blocks
+ *     examined per malloc and the final resident share of the peak on
+ *     each trace for all of them
+ */
+static void sweep_env(const char *var, char *values, int n, char **tracefiles)
+{
+    char *names[MAXLINE/2];
+    stats_t *stats[MAXLINE/2];
+    int i, j, nord = 0;
+    double util, ops, secs, scans, rss;
+    char *saved = getenv(var) ? strdup(getenv(var)) : NULL;
+
+    for (names[0] = strtok(values, ","); names[nord] != NULL && nord < MAXLINE/2 - 1;
+	 names[++nord] = strtok(NULL, ","))
+	;
+    for (j = 0; j < nord; j++) {
+	if ((stats[j] = (stats_t *)calloc(n, sizeof(stats_t))) == NULL)
+	    unix_error("stats calloc in sweep_orders failed");
+	if (setenv(var, names[j], 1) < 0)
+	    unix_error("setenv in sweep_env failed");
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with %s=%s\n", var, names[j]);
+	eval_mm(n, tracefiles, stats[j]);
+    }
+    /* Put back whatever the caller had set */
+    if (saved != NULL) {
+	setenv(var, saved, 1);
+	free(saved);
+    }
+    else
+	unsetenv(var);
+
+    printf("\n%s:\n%5s", var, "trace");
+    for (j = 0; j < nord; j++)
+	printf("%27s", names[j]);
+    printf("\n%5s", "");
+    for (j = 0; j < nord; j++)
+	printf("%8s%7s%6s%6s", "util", "Kops", "scan", "rss");
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	printf("%2d   ", i);
+	for (j = 0; j < nord; j++) {
+	    if (stats[j][i].valid)
+		printf("%7.0f%%%7.0f%6.1f%5.0f%%", stats[j][i].util*100.0,
+		       (stats[j][i].ops/1e3)/stats[j][i].secs,
+		       stats[j][i].scans, stats[j][i].rss*100.0);
+	    else
+		printf("%8s%7s%6s%6s", "-", "-", "-", "-");
+	}
+	printf("\n");
+    }
+    printf("%5s", "Total");
+    for (j = 0; j < nord; j++) {
+	util = ops = secs = scans = rss = 0;
+	for (i = 0; i < n; i++) {
+	    if (!stats[j][i].valid)
+		break;
+	    util += stats[j][i].util;
+	    ops += stats[j][i].ops;
+	    secs += stats[j][i].secs;
+	    scans += stats[j][i].scans;
+	    rss += stats[j][i].rss;
+	}
+	if (i == n)
+	    printf("%7.0f%%%7.0f%6.1f%5.0f%%", (util/n)*100.0, (ops/1e3)/secs,
+		   scans/n, (rss/n)*100.0);
+	else
+	    printf("%8s%7s%6s%6s", "-", "-", "-", "-");
+	free(stats[j]);
+    }
+    printf("\n");
+    if (errors)
+	printf("Terminated with %d errors\n", errors);
+}
+
+/*
+ * dtlb_misses - Replay the trace once more under a counter of dTLB
+ *     load misses and return the count, or -1 if perf events are not
+ *     available (not Linux, or perf_event_paranoid forbids it)
+ */
+static double dtlb_misses(speed_t *params)
+{
+#ifdef __linux__
+    struct perf_event_attr pe;
+    long long count;
+    int fd;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HW_CACHE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_DTLB |
+	(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    if ((fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0)) < 0)
+	return -1;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    eval_mm_speed(params);
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+	count = -1;
+    close(fd);
+    return (double)count;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * compare_pages - Evaluate the mm package with the heap in base pages
+ *     and again in huge pages, and print throughput and dTLB load
+ *     misses per thousand operations on each trace for both, with the
+ *     change in misses
+ */
+static void compare_pages(int n, char **tracefiles)
+{
+    static const char *names[] = {"base pages", "THP", "hugetlb"};
+    stats_t *stats[2];
+    int i, j, pages[2];
+    double ops, secs, tlb[2];
+    char buf[2][16], delta[16];
+
+    count_tlb = 1;
+    for (j = 0; j < 2; j++) {
+	if ((stats[j] = (stats_t *)calloc(n, sizeof(stats_t))) == NULL)
+	    unix_error("stats calloc in compare_pages failed");
+	mem_reset_brk();
+	mem_deinit();
+	mem_set_huge(j);
+	mem_init();
+	pages[j] = mem_huge_pages();
+	if (verbose > 1)
+	    printf("\nTesting mm malloc with %s\n", names[pages[j]]);
+	eval_mm(n, tracefiles, stats[j]);
+    }
+    count_tlb = 0;
+
+    if (pages[1] == MEM_PAGES_BASE)
+	printf("\nNo huge pages available, both runs used base pages\n");
+    printf("\n%5s", "trace");
+    for (j = 0; j < 2; j++)
+	printf("%17s", names[pages[j]]);
+    printf("%8s\n%5s", "dTLB", "");
+    for (j = 0; j < 2; j++)
+	printf("%7s%10s", "Kops", "dTLB/Kop");
+    printf("%8s\n", "change");
+    for (i = 0; i <= n; i++) {
+	/* Row n is the total over every trace */
+	if (i < n)
+	    printf("%2d   ", i);
+	else
+	    printf("%5s", "Total");
+	for (j = 0; j < 2; j++) {
+	    int k, lo = i < n ? i : 0, hi = i < n ? i + 1 : n;
+	    ops = secs = tlb[j] = 0;
+	    for (k = lo; k < hi; k++) {
+		if (!stats[j][k].valid || stats[j][k].tlb < 0)
+		    tlb[j] = -1;
+		if (tlb[j] >= 0)
+		    tlb[j] += stats[j][k].tlb;
+		ops += stats[j][k].ops;
+		secs += stats[j][k].secs;
+	    }
+	    if (tlb[j] < 0)
+		strcpy(buf[j], "n/a");
+	    else
+		sprintf(buf[j], "%.1f", tlb[j] / (ops/1e3));
+	    printf("%7.0f%10s", (ops/1e3)/secs, buf[j]);
+	}
+	if (tlb[0] > 0 && tlb[1] >= 0)
+	    sprintf(delta, "%+.0f%%", (tlb[1] - tlb[0]) / tlb[0] * 100.0);
+	else
+	    strcpy(delta, "n/a");
+	printf("%8s\n", delta);
+    }
+    for (j = 0; j < 2; j++)
+	free(stats[j]);
+    if (errors)
+	printf("Terminated with %d errors\n", errors);
+}
+
+/*
+ * inbox_put - Leave a block in an inbox for its thread to free
+ */
+static void inbox_put(inbox_t *in, char *p)
+{
+    pthread_mutex_lock(&in->lock);
+    if (in->n == in->max) {
+	in->max = in->max ? 2 * in->max : 64;
+	if ((in->ptrs = (char **)realloc(in->ptrs, in->max * sizeof(char *))) == NULL)
+	    unix_error("realloc in inbox_put failed");
+    }
+    in->ptrs[in->n++] = p;
+    pthread_mutex_unlock(&in->lock);
+}
+
+/*
+ * inbox_free - Free every block left in an inbox
+ */
+static void inbox_free(inbox_t *in)
+{
+    char **ptrs;
+    int i, n;
+
+    pthread_mutex_lock(&in->lock);
+    ptrs = in->ptrs;
+    n = in->n;
+    in->ptrs = NULL;
+    in->n = in->max = 0;
+    pthread_mutex_unlock(&in->lock);
+    for (i = 0; i < n; i++)
+	mm_free(ptrs[i]);
+    free(ptrs);
+}
+
+/*
+ * replay_trace - A thread's body for eval_mm_threads. Runs every request
+ *     of the trace against its own table of blocks, tagging the first
+ *     and last byte of each payload and checking them before the block
+ *     is resized or freed. With -X its frees go to the next thread's
+ *     inbox, and it frees what is in its own each time it frees.
+ */
+static void *replay_trace(void *arg)
+{
+    replay_t *r = (replay_t *)arg;
+    trace_t *trace = r->trace;
+    int i, index, size, old;
+    char *p;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+	p = r->blocks[index];
+	old = r->sizes[index];
+	if (trace->ops[i].type != ALLOC && p != NULL && old > 0 &&
+	    (p[0] != r->id || p[old-1] != r->id))
+	    r->bad++;
+	switch (trace->ops[i].type) {
+	case ALLOC:
+	case REALLOC:
+	    p = trace->ops[i].type == ALLOC ? mm_malloc(size) : mm_realloc(p, size);
+	    if (p == NULL) {
+		r->nomem++;
+		size = 0;
+	    }
+	    else if (size > 0)
+		p[0] = p[size-1] = r->id;
+	    r->blocks[index] = p;
+	    r->sizes[index] = size;
+	    break;
+	case FREE:
+	    if (handoff) {
+		if (p != NULL)
+		    inbox_put(&r->next->inbox, p);
+		inbox_free(&r->inbox);
+	    }
+	    else if (p != NULL)
+		mm_free(p);
+	    r->blocks[index] = NULL;
+	    r->sizes[index] = 0;
+	    break;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * replay_secs - Time nthreads threads replaying trace at the same time
+ *     on a freshly initialized heap, returning the wall clock seconds
+ */
+static double replay_secs(trace_t *trace, int nthreads)
+{
+    replay_t *r;
+    struct timespec t0, t1;
+    int j, nomem;
+
+    if ((r = (replay_t *)calloc(nthreads, sizeof(replay_t))) == NULL)
+	unix_error("calloc in replay_secs failed");
+    for (j = 0; j < nthreads; j++) {
+	r[j].trace = trace;
+	r[j].id = j + 1;
+	r[j].next = &r[(j + 1) % nthreads];
+	pthread_mutex_init(&r[j].inbox.lock, NULL);
+	if ((r[j].blocks = (char **)calloc(trace->num_ids, sizeof(char *))) == NULL ||
+	    (r[j].sizes = (int *)calloc(trace->num_ids, sizeof(int))) == NULL)
+	    unix_error("calloc in replay_secs failed");
+    }
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in replay_secs");
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (j = 0; j < nthreads; j++)
+	if (pthread_create(&r[j].tid, NULL, replay_trace, &r[j]) != 0)
+	    unix_error("pthread_create in replay_secs failed");
+    for (j = 0; j < nthreads; j++)
+	pthread_join(r[j].tid, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    /* Blocks handed on after their thread's last free */
+    for (j = 0; j < nthreads; j++)
+	inbox_free(&r[j].inbox);
+
+    nomem = 0;
+    for (j = 0; j < nthreads; j++) {
+	if (r[j].bad) {
+	    printf("ERROR: thread %d of %d saw %d overwritten blocks\n",
+		   j + 1, nthreads, r[j].bad);
+	    errors++;
+	}
+	nomem += r[j].nomem;
+	free(r[j].blocks);
+	free(r[j].sizes);
+	pthread_mutex_destroy(&r[j].inbox.lock);
+    }
+    free(r);
+    /* Heap exhaustion, not corruption: the threads' live blocks together
+       can outgrow the reservation (raise it with -r) */
+    if (nomem)
+	printf("%d threads ran out of memory on %d requests\n", nthreads, nomem);
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/*
+ * eval_mm_threads - Replay each trace in one thread and then in
+ *     nthreads threads sharing the heap, each with its own blocks, and
+ *     print the throughput of both (all threads' requests over the
+ *     best of three wall clock times), the speedup, and how often the
+ *     threads waited for a heap or list lock and for the growth lock
+ *     (per thousand requests, over the three runs)
+ */
+static void eval_mm_threads(int nthreads, int n, char **tracefiles)
+{
+    trace_t *trace;
+    int i, j, k, counts[2] = {1, nthreads};
+    double best[2], secs, ops = 0, total[2] = {0, 0};
+    double waits[2], allwaits[2] = {0, 0};
+
+    char head[16];
+
+    sprintf(head, "%d threads", nthreads);
+    printf("\n%5s%10s%11s%9s%8s%8s\n", "trace", "1 thread", head, "speedup",
+	   "waits", "grow");
+    for (i = 0; i < n; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	waits[0] = waits[1] = 0;
+	for (k = 0; k < 2; k++) {
+	    best[k] = DBL_MAX;
+	    for (j = 0; j < 3; j++) {
+		if ((secs = replay_secs(trace, counts[k])) < best[k])
+		    best[k] = secs;
+		if (k == 1) {
+		    waits[0] += mm_lock_waits;
+		    waits[1] += mm_grow_waits;
+		}
+	    }
+	    total[k] += best[k] / counts[k];
+	}
+	ops += trace->num_ops;
+	allwaits[0] += waits[0];
+	allwaits[1] += waits[1];
+	printf("%2d   %10.0f%11.0f%8.2fx%8.2f%8.2f\n", i,
+	       (trace->num_ops/1e3)/best[0],
+	       (nthreads*trace->num_ops/1e3)/best[1],
+	       nthreads*best[0]/best[1],
+	       waits[0] / (3*nthreads*trace->num_ops/1e3),
+	       waits[1] / (3*nthreads*trace->num_ops/1e3));
+	free_trace(trace);
+    }
+    printf("%5s%10.0f%11.0f%8.2fx%8.2f%8.2f\n", "Total",
+	   (ops/1e3)/total[0], (ops/1e3)/total[1], total[0]/total[1],
+	   allwaits[0] / (3*nthreads*ops/1e3), allwaits[1] / (3*nthreads*ops/1e3));
+    if (errors)
+	printf("Terminated with %d errors\n", errors);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -939,22 +1451,39 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double scans = 0;
+    double rss = 0;
+    char scan[16], res[16];
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%10s%6s%7s%6s\n", 
+	   "trace", " valid", "util", "ops", "secs", "Kops", "scan", "rss");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    /* Free blocks examined per malloc, only known for mm */
+	    if (stats[i].scans < 0)
+		strcpy(scan, "-");
+	    else
+		sprintf(scan, "%.1f", stats[i].scans);
+	    /* Resident share of the peak when the trace ends, likewise */
+	    if (stats[i].rss < 0)
+		strcpy(res, "-");
+	    else
+		sprintf(res, "%.0f%%", stats[i].rss*100.0);
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f%7s%6s\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
-		   (stats[i].ops/1e3)/stats[i].secs);
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   scan,
+		   res);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    scans += stats[i].scans;
+	    rss += stats[i].rss;
 	}
 	else {
 	    printf("%2d%10s%6s%8s%10s%6s\n", 
@@ -969,12 +1498,22 @@ static void printresults(int n, stats_t *stats)
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	if (scans < 0)
+	    strcpy(scan, "-");
+	else
+	    sprintf(scan, "%.1f", scans/n);
+	if (rss < 0)
+	    strcpy(res, "-");
+	else
+	    sprintf(res, "%.0f%%", (rss/n)*100.0);
+	printf("%12s%5.0f%%%8.0f%10.6f%6.0f%7s%6s\n", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
 	       secs,
-	       (ops/1e3)/secs);
+	       (ops/1e3)/secs,
+	       scan,
+	       res);
     }
     else {
 	printf("%12s%6s%8s%10s%6s\n", 
@@ -1019,14 +1558,22 @@ void malloc_error(int tracenum, int opnum, const char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-p <list>] [-F <list>] [-S <list>] [-P <list>] [-r <MB>] [-H] [-T <n> [-X]]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Compare a base page heap with a huge page heap.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-p <list>  Compare free list orders, e.g. lifo,addr,size.\n");
+    fprintf(stderr, "\t-r <MB>    Reserve <MB> of address space for the heap.\n");
+    fprintf(stderr, "\t-F <list>  Compare placement modes, e.g. first,next,good.\n");
+    fprintf(stderr, "\t-S <list>  Compare high end split thresholds, e.g. 0,256,1024.\n");
+    fprintf(stderr, "\t-P <list>  Compare purge ages, e.g. 0,1000,100.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Replay each trace in <n> threads at once (mdriver-mt).\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
+    fprintf(stderr, "\t-X         With -T, each thread frees the blocks the one before it frees.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
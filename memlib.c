@@ -3,35 +3,188 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE     /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* Pages are made usable this many bytes at a time as the heap grows */
+#define COMMIT_CHUNK (1<<16)
+
+/* Size of a huge page, the unit of a huge page backed heap */
+#define HUGE_PAGE (1<<21)
+
+/*
+ * The reservation is cut into mem_nsegs equal segments, each a heap
+ * with a brk of its own. Segment 0 is the heap of mem_sbrk, and a
+ * segment is only ever grown by one caller at a time.
+ */
+typedef struct segment {
+    char *start;     /* first byte of the segment */
+    char *brk;       /* one past its last heap byte */
+    char *max;       /* end of its reservation */
+    char *commit;    /* end of the pages that may be touched */
+} segment_t;
+
 /* private variables */
 char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static segment_t mem_segs[MEM_MAX_SEGS];
+static int mem_nsegs = 1;    /* segments mem_init makes */
+static size_t mem_total;     /* bytes in the heaps of all segments */
+static size_t mem_reserve = MAX_HEAP; /* address space for each segment */
+static int mem_want_huge;    /* back the heap with huge pages if we can */
+static int mem_pages = MEM_PAGES_BASE; /* what the heap is backed by */
+static size_t mem_commit_chunk = COMMIT_CHUNK; /* least bytes committed */
+static size_t mem_unit;      /* least bytes mem_purge gives back */
+
+/* Pages handed out by mem_map, outside the heap */
+typedef struct mapping {
+    char *addr;
+    size_t size;
+    struct mapping *next;
+} mapping_t;
+
+static mapping_t *mem_maps;  /* live mappings */
+static size_t mem_mapped;    /* bytes in live mappings */
+static size_t mem_peak;      /* largest heap size plus mapped bytes so far */
+
+/* Held for mem_total, mem_peak and the mappings, which all segments share */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Record a new high water mark of heap plus mapped bytes, under mem_lock */
+static void mem_note_peak(void)
+{
+    size_t size = mem_total + mem_mapped;
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
+/* Account for a segment's heap growing or shrinking by incr bytes */
+static void mem_note_heap(int incr)
+{
+    pthread_mutex_lock(&mem_lock);
+    mem_total += incr;
+    mem_note_peak();
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/*
+ * mem_set_reserve - set how many bytes of address space mem_init
+ *    reserves for each segment (MAX_HEAP unless this is called first)
+ */
+void mem_set_reserve(size_t size)
+{
+    mem_reserve = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+}
+
+/*
+ * mem_set_segments - set how many heap segments mem_init makes (one
+ *    unless this is called first)
+ */
+void mem_set_segments(int n)
+{
+    mem_nsegs = n < 1 ? 1 : n > MEM_MAX_SEGS ? MEM_MAX_SEGS : n;
+}
+
+/*
+ * mem_set_huge - ask mem_init to back the heap with huge pages
+ */
+void mem_set_huge(int on)
+{
+    mem_want_huge = on;
+}
+
+/*
+ * mem_huge_pages - returns what mem_init managed to back the heap with:
+ *    MEM_PAGES_HUGETLB, MEM_PAGES_THP or MEM_PAGES_BASE
+ */
+int mem_huge_pages()
+{
+    return mem_pages;
+}
+
+/*
+ * reserve_huge - reserve HUGE_PAGE aligned segments. MAP_HUGETLB pages
+ *    are reserved up front, so the mmap fails cleanly when the pool is
+ *    too small; otherwise transparent huge pages are requested for an
+ *    aligned range of ordinary pages. Returns NULL if that fails too.
+ */
+static char *reserve_huge(void)
+{
+    size_t total;
+    char *p;
+
+    mem_reserve = (mem_reserve + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    total = mem_reserve * mem_nsegs;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, total, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+	mem_pages = MEM_PAGES_HUGETLB;
+	mem_unit = HUGE_PAGE;
+	return p;
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    /* Over-reserve by a huge page and cut both ends back to alignment */
+    p = mmap(NULL, total + HUGE_PAGE, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+	return NULL;
+    char *start = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (start > p)
+	munmap(p, start - p);
+    munmap(start + total, p + HUGE_PAGE - start);
+    if (madvise(start, total, MADV_HUGEPAGE) == 0) {
+	mem_pages = MEM_PAGES_THP;
+	return start;
+    }
+    munmap(start, total);
+#endif
+    return NULL;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    int i;
+
+    mem_pages = MEM_PAGES_BASE;
+    mem_unit = mem_pagesize();
+    mem_start_brk = NULL;
+    /* reserve the address space we will use to model the available VM,
+       none of it is usable until mem_sbrk commits it */
+    if (mem_want_huge)
+	mem_start_brk = reserve_huge();
+    if (mem_start_brk == NULL)
+	mem_start_brk = mmap(NULL, mem_reserve * mem_nsegs, PROT_NONE,
+			     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error: %s\n", strerror(errno));
 	exit(1);
     }
+    /* Commit whole huge pages, so none is split by a protection change */
+    mem_commit_chunk = mem_pages == MEM_PAGES_BASE ? COMMIT_CHUNK : HUGE_PAGE;
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    /* every segment's heap is empty initially */
+    for (i = 0; i < mem_nsegs; i++) {
+	mem_segs[i].start = mem_start_brk + i * mem_reserve;
+	mem_segs[i].brk = mem_segs[i].start;
+	mem_segs[i].max = mem_segs[i].start + mem_reserve;
+	mem_segs[i].commit = mem_segs[i].start;
+    }
+    mem_total = 0;
 }
 
 /* 
@@ -39,32 +192,80 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, mem_reserve * mem_nsegs);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    and unmap whatever mem_map handed out
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    int i;
+
+    for (i = 0; i < mem_nsegs; i++)
+	mem_segs[i].brk = mem_segs[i].start;
+    mem_total = 0;
+    while (mem_maps != NULL)
+	mem_unmap(mem_maps->addr, mem_maps->size);
+    mem_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area, or
+ *    shrinks it by -incr bytes and gives back the pages it released.
+ *    Reserved pages become readable and writable, COMMIT_CHUNK bytes
+ *    (a huge page with huge pages) at a time, as the brk first passes
+ *    them.
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    return mem_seg_sbrk(0, incr);
+}
+
+/*
+ * mem_seg_sbrk - mem_sbrk for the heap in segment seg
+ */
+void *mem_seg_sbrk(int seg, int incr)
+{
+    segment_t *s = &mem_segs[seg];
+    char *old_brk = s->brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0) {
+	if (s->brk + incr < s->start) {
+	    errno = EINVAL;
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap...\n");
+	    return (void *)-1;
+	}
+	s->brk += incr;
+	/* The pages just given back stay committed but not resident */
+	mem_purge(s->brk, -incr);
+	mem_note_heap(incr);
+	return (void *)old_brk;
+    }
+    if ((s->brk + incr) > s->max) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
-    mem_brk += incr;
+    /* Make the pages under the new brk usable */
+    if (s->brk + incr > s->commit) {
+	char *end = s->start +
+	    (((s->brk + incr - s->start) + mem_commit_chunk - 1) &
+	     ~(mem_commit_chunk - 1));
+	if (end > s->max)
+	    end = s->max;
+	if (mprotect(s->commit, end - s->commit,
+		     PROT_READ | PROT_WRITE) < 0) {
+	    fprintf(stderr, "ERROR: mem_sbrk failed to commit: %s\n",
+		    strerror(errno));
+	    return (void *)-1;
+	}
+	s->commit = end;
+    }
+    s->brk += incr;
+    mem_note_heap(incr);
     return (void *)old_brk;
 }
 
@@ -77,19 +278,57 @@ void *mem_heap_lo()
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last heap byte, in the highest
+ *    segment with a heap
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    int i;
+
+    for (i = mem_nsegs - 1; i > 0 && mem_segs[i].brk == mem_segs[i].start; i--)
+	;
+    return (void *)(mem_segs[i].brk - 1);
+}
+
+/*
+ * mem_seg_lo - return address of the first byte of segment seg
+ */
+void *mem_seg_lo(int seg)
+{
+    return (void *)mem_segs[seg].start;
+}
+
+/*
+ * mem_segments - returns the number of heap segments
+ */
+int mem_segments()
+{
+    return mem_nsegs;
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_maxheap() - returns the most the heap in a segment can grow to
+ *    in bytes
+ */
+size_t mem_maxheap()
+{
+    return mem_reserve;
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes, over all segments
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return mem_total;
+}
+
+/*
+ * mem_seg_size() - returns the size in bytes of the heap in segment seg
+ */
+size_t mem_seg_size(int seg)
+{
+    return (size_t)(mem_segs[seg].brk - mem_segs[seg].start);
 }
 
 /*
@@ -99,3 +338,185 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_map - map size bytes, rounded up to whole pages, of fresh memory
+ *    outside the heap. Returns the page aligned start or NULL.
+ */
+void *mem_map(size_t size)
+{
+    mapping_t *m;
+    char *addr;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+	fprintf(stderr, "ERROR: mem_map failed: %s\n", strerror(errno));
+	return NULL;
+    }
+    if ((m = (mapping_t *)malloc(sizeof(mapping_t))) == NULL) {
+	munmap(addr, size);
+	return NULL;
+    }
+    m->addr = addr;
+    m->size = size;
+    pthread_mutex_lock(&mem_lock);
+    m->next = mem_maps;
+    mem_maps = m;
+    mem_mapped += size;
+    mem_note_peak();
+    pthread_mutex_unlock(&mem_lock);
+    return addr;
+}
+
+/*
+ * mem_unmap - give back a mapping made by mem_map(size)
+ */
+void mem_unmap(void *addr, size_t size)
+{
+    mapping_t **mp, *m;
+
+    size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    pthread_mutex_lock(&mem_lock);
+    for (mp = &mem_maps; (m = *mp) != NULL; mp = &m->next)
+	if (m->addr == addr) {
+	    assert(m->size == size);
+	    *mp = m->next;
+	    mem_mapped -= m->size;
+	    pthread_mutex_unlock(&mem_lock);
+	    munmap(m->addr, m->size);
+	    free(m);
+	    return;
+	}
+    pthread_mutex_unlock(&mem_lock);
+    fprintf(stderr, "ERROR: mem_unmap of %p, which is not mapped\n", addr);
+}
+
+/*
+ * mem_remap - resize a mapping made by mem_map(oldsize) to newsize bytes,
+ *    moving its pages rather than copying them if it has to move.
+ *    Returns the new start or NULL, in which case the old mapping stands.
+ */
+void *mem_remap(void *addr, size_t oldsize, size_t newsize)
+{
+    mapping_t *m;
+    char *naddr;
+
+    oldsize = (oldsize + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    newsize = (newsize + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    pthread_mutex_lock(&mem_lock);
+    for (m = mem_maps; m != NULL && m->addr != addr; m = m->next)
+	;
+    if (m == NULL) {
+	pthread_mutex_unlock(&mem_lock);
+	fprintf(stderr, "ERROR: mem_remap of %p, which is not mapped\n", addr);
+	return NULL;
+    }
+    assert(m->size == oldsize);
+    naddr = mremap(addr, oldsize, newsize, MREMAP_MAYMOVE);
+    if (naddr == MAP_FAILED) {
+	pthread_mutex_unlock(&mem_lock);
+	fprintf(stderr, "ERROR: mem_remap failed: %s\n", strerror(errno));
+	return NULL;
+    }
+    m->addr = naddr;
+    m->size = newsize;
+    mem_mapped = mem_mapped - oldsize + newsize;
+    mem_note_peak();
+    pthread_mutex_unlock(&mem_lock);
+    return naddr;
+}
+
+/*
+ * mem_purge - give the whole heap pages within [addr, addr+size) back
+ *    to the system, as madvise(MADV_DONTNEED) does. They stay usable
+ *    and read as zero when next touched. MAP_HUGETLB pages can only be
+ *    given back whole.
+ */
+void mem_purge(void *addr, size_t size)
+{
+    uintptr_t page = mem_unit;
+    uintptr_t lo = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)addr + size) & ~(page - 1);
+    size_t seg = ((char *)addr - mem_start_brk) / mem_reserve;
+
+    /* Only the committed part of addr's segment */
+    if ((char *)addr < mem_start_brk || seg >= (size_t)mem_nsegs)
+	return;
+    if (lo < (uintptr_t)mem_segs[seg].start)
+	lo = (uintptr_t)mem_segs[seg].start;
+    if (hi > (uintptr_t)mem_segs[seg].commit)
+	hi = (uintptr_t)mem_segs[seg].commit;
+    if (hi > lo)
+	madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * resident - the resident bytes of [lo, lo+size), page aligned
+ */
+static size_t resident(char *lo, size_t size)
+{
+    size_t page = mem_pagesize(), n = 0, i;
+    unsigned char *vec;
+
+    if (size == 0 || (vec = (unsigned char *)malloc(size / page + 1)) == NULL)
+	return 0;
+    if (mincore(lo, size, vec) == 0)
+	for (i = 0; i < (size + page - 1) / page; i++)
+	    n += vec[i] & 1;
+    free(vec);
+    return n * page;
+}
+
+/*
+ * mem_resident - returns the bytes of the heap and of live mappings
+ *    that are resident in memory
+ */
+size_t mem_resident()
+{
+    size_t n = 0;
+    mapping_t *m;
+    int i;
+
+    for (i = 0; i < mem_nsegs; i++)
+	n += resident(mem_segs[i].start, mem_segs[i].commit - mem_segs[i].start);
+    pthread_mutex_lock(&mem_lock);
+    for (m = mem_maps; m != NULL; m = m->next)
+	n += resident(m->addr, m->size);
+    pthread_mutex_unlock(&mem_lock);
+    return n;
+}
+
+/*
+ * mem_is_mapped - true if [lo, lo+size) lies within one live mapping
+ */
+int mem_is_mapped(void *lo, size_t size)
+{
+    mapping_t *m;
+    int found = 0;
+
+    pthread_mutex_lock(&mem_lock);
+    for (m = mem_maps; m != NULL && !found; m = m->next)
+	if ((char *)lo >= m->addr && (char *)lo + size <= m->addr + m->size)
+	    found = 1;
+    pthread_mutex_unlock(&mem_lock);
+    return found;
+}
+
+/*
+ * mem_mapsize - returns the bytes currently mapped by mem_map
+ */
+size_t mem_mapsize()
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_peaksize - returns the most memory, heap plus mappings, in use
+ *    at any one time since the last mem_reset_brk
+ */
+size_t mem_peaksize()
+{
+    return mem_peak;
+}
@@ -1,11 +1,36 @@
 #include <unistd.h>
 
+/* What the heap is backed by, see mem_set_huge */
+#define MEM_PAGES_BASE    0
+#define MEM_PAGES_THP     1     /* madvise(MADV_HUGEPAGE) */
+#define MEM_PAGES_HUGETLB 2     /* mmap(MAP_HUGETLB) */
+
+/* Most heap segments, see mem_set_segments */
+#define MEM_MAX_SEGS      64
+
+void mem_set_reserve(size_t size);
+void mem_set_huge(int on);
+void mem_set_segments(int n);
+int mem_huge_pages(void);
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_seg_sbrk(int seg, int incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_seg_lo(int seg);
+int mem_segments(void);
 size_t mem_heapsize(void);
+size_t mem_seg_size(int seg);
+size_t mem_maxheap(void);
 size_t mem_pagesize(void);
+void mem_purge(void *addr, size_t size);
+size_t mem_resident(void);
+void *mem_map(size_t size);
+void mem_unmap(void *addr, size_t size);
+void *mem_remap(void *addr, size_t oldsize, size_t newsize);
+int mem_is_mapped(void *lo, size_t size);
+size_t mem_mapsize(void);
+size_t mem_peaksize(void);
 
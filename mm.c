@@ -1,27 +1,34 @@
 /*
- * mm-implicit.c -  Simple allocator based on implicit free lists,
- *                  first fit placement, and boundary tag coalescing.
+ * mm.c -  Allocator based on segregated explicit free lists,
+ *         first fit placement, and boundary tag coalescing.
  *
- * Each block has header and footer of the form:
+ * Every block starts with a one word header of the form:
  *
  *      31                     3  2  1  0
  *      -----------------------------------
- *     | s  s  s  s  ... s  s  s  0  0  a/f
+ *     | s  s  s  s  ... s  s  s  0  p  a/f
  *      -----------------------------------
  *
- * where s are the meaningful size bits and a/f is set
- * iff the block is allocated. The list has the following form:
+ * where s are the meaningful size bits, a/f is set iff the block is
+ * allocated and p is set iff the block before it is allocated. Only
+ * free blocks carry the list links and a footer holding their size, so
+ * an allocated block costs just its header. The links are 32-bit
+ * offsets from the start of the heap, so a free block needs only 16
+ * bytes. The heap has the form:
  *
  * begin                                                          end
  * heap                                                           heap
  *  -----------------------------------------------------------------
- * |  pad   | hdr(8:a) | ftr(8:a) | zero or more usr blks | hdr(8:a) |
+ * | pad | hdr(a) | NBINS list roots | zero or more usr blks | hdr(0:a) |
  *  -----------------------------------------------------------------
- *          |       prologue      |                       | epilogue |
- *          |         block       |                       | block    |
+ *       |      prologue block       |                       | epilogue |
  *
  * The allocated prologue and epilogue blocks are overhead that
  * eliminate edge conditions during coalescing.
+ *
+ * Requests of at most SLAB_MAX bytes do not get a block of their own.
+ * They are slots in a run: an allocated block whose payload is one
+ * page of same-sized objects, with a bitmap of free slots at its start.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -57,9 +64,199 @@ team_t team = {
 /////////////////////////////////////////////////////////////////////////////
 #define WSIZE       4       /* word size (bytes) */
 #define DSIZE       8       /* doubleword size (bytes) */
-#define CHUNKSIZE  (1<<12)  /* initial heap size (bytes) */
+#ifndef CHUNKSIZE
+#define CHUNKSIZE  (1<<12)  /* least amount to extend the heap by (bytes) */
+#endif
 #define OVERHEAD    8       /* overhead of header and footer (bytes) */
-#define FOVERHEAD   32      //
+#define FOVERHEAD   16      // smallest remainder worth splitting off
+#define SMALL_BINS  8       // bins below SMALL_LIMIT are 16 bytes apart
+#define SMALL_LIMIT 128     // smallest size served by a power-of-two bin
+
+//
+// Build with -DTLSF=1 to index the free lists as a two-level
+// segregated fit: each power of two is split into SL_COUNT bins and
+// non-empty bins are tracked in bitmaps, so find_fit never walks a list.
+//
+#ifndef TLSF
+#define TLSF        0
+#endif
+
+#if TLSF
+#define SL_BITS     3               // log2 of second-level bins per class
+#define SL_COUNT    (1 << SL_BITS)
+#define FL_COUNT    26              // first level 0 is the small range
+#define NBINS       (FL_COUNT * SL_COUNT)
+#else
+#define NBINS       32      // number of segregated free lists
+#endif
+
+//
+// Free blocks of at least TREE_MIN bytes are kept in a size-ordered
+// tree for best fit instead of on the lists (-DTREE_MIN=512). Zero
+// leaves every block on the lists.
+//
+#ifndef TREE_MIN
+#define TREE_MIN    0
+#endif
+
+//
+// Order of the blocks on each list, picked by mm_init from $MM_ORDER:
+// "lifo" (the default), "addr" for address order or "size" for
+// smallest first. TLSF builds are LIFO only.
+//
+enum { ORDER_LIFO, ORDER_ADDR, ORDER_SIZE };
+#define ADDR_SHIFT  14          // log2 of the least address index page
+#define ADDR_PAGES  (1 << 14)   // pages in the address index
+#define ADDR_WORDS  ((ADDR_PAGES + 63) / 64)
+
+//
+// Placement within the lists, picked by mm_init from $MM_FIT: "first"
+// (the default), "next" to resume from where the last search stopped,
+// or "good" for the tightest of the first $MM_FIT_K (default FIT_K)
+// blocks that fit. TLSF builds are first fit only.
+//
+enum { FIT_FIRST, FIT_NEXT, FIT_GOOD };
+#define FIT_K       8
+
+//
+// Requests for at least $MM_SPLIT bytes are carved from the high end of
+// the free block they are placed in, smaller ones from the low end, so
+// the two kinds do not interleave. That includes the wilderness, whose
+// low remainder then goes on the lists. Zero (the default) carves
+// everything from the low end.
+//
+#ifndef SPLIT_HIGH
+#define SPLIT_HIGH  0
+#endif
+
+#if TLSF && TREE_MIN
+#error "TLSF and TREE_MIN are alternative free block indexes"
+#endif
+
+//
+// Requests of up to SLAB_MAX bytes are served from page-sized runs of
+// equal-sized objects with no header of their own (-DSLAB_MAX=0 turns
+// this off). A run is an ordinary allocated block whose payload is
+// RUN_SIZE aligned, so an object's run is found by aligning down.
+//
+#ifndef SLAB_MAX
+#define SLAB_MAX    128
+#endif
+#define RUN_SIZE    4096
+#define RUN_CLASSES (SLAB_MAX / 8)      // one class per 8 bytes
+#define RUN_MAPWORDS (RUN_SIZE / 8 / 64) // enough bits for 8-byte objects
+#define HEAP_PAGES  (1u << 20)          // RUN_SIZE pages in a 4 GB heap
+
+//
+// Freed blocks of at most QUICK_MAX bytes go on exact-size quick lists
+// without being coalesced, and are only merged into the free lists when
+// find_fit misses or a quick list grows past QUICK_LEN blocks.
+// -DQUICK_MAX=0 frees every block immediately. With MM_THREADS the
+// lists are lock-free stacks, and a thread cache miss of that size is
+// served from them without taking the lock.
+//
+#ifndef QUICK_MAX
+#define QUICK_MAX   0
+#endif
+#ifndef QUICK_LEN
+#define QUICK_LEN   64
+#endif
+
+//
+// Requests of at least MMAP_MIN bytes get pages of their own from
+// mem_map, outside the heap, and give them back as soon as they are
+// freed. -DMMAP_MIN=0 keeps everything in the heap.
+//
+#ifndef MMAP_MIN
+#define MMAP_MIN    (1 << 17)
+#endif
+
+//
+// With -DTRIM_MIN=<bytes>, a wilderness that grows to TRIM_MIN bytes when
+// a block is freed into it is cut back to CHUNKSIZE, and the top of the
+// heap is given back with a negative mem_sbrk. It is off by default:
+// the pages given back fault in again as soon as the heap regrows.
+//
+#ifndef TRIM_MIN
+#define TRIM_MIN    0
+#endif
+
+#if TRIM_MIN && TRIM_MIN <= CHUNKSIZE
+#error "TRIM_MIN must be larger than CHUNKSIZE"
+#endif
+
+//
+// Free blocks of at least PURGE_MIN bytes that stay free for $MM_PURGE
+// calls to mm_malloc and mm_free have their interior pages purged, so
+// they stop counting towards the resident set until they are reused.
+// $MM_PURGE defaults to PURGE_AGE, and 0 never purges. -DPURGE_MIN=0
+// leaves the purge clock out altogether.
+//
+#ifndef PURGE_MIN
+#define PURGE_MIN   (1 << 14)
+#endif
+#ifndef PURGE_AGE
+#define PURGE_AGE   0
+#endif
+
+//
+// -DMM_THREADS=1 makes the allocator safe to call from several threads
+// ("make mdriver-mt"). The heap is behind one lock, and each thread
+// caches up to TCACHE_LEN freed objects of each size up to TCACHE_MAX
+// bytes, so most malloc/free pairs never take it.
+//
+// -DMM_ARENAS=n (with MM_THREADS, "make mdriver-arena") splits it into
+// n heaps, one per memlib segment and each behind its own lock. Threads
+// are bound to arenas round robin on their first malloc, and a block is
+// freed into the arena whose segment holds it, whichever thread frees it.
+// A thread freeing another arena's block pushes it on that arena's
+// remote stack without taking the lock, and the arena's own threads
+// free what has been pushed the next time they malloc.
+//
+#ifndef MM_THREADS
+#define MM_THREADS  0
+#endif
+#ifndef TCACHE_MAX
+#define TCACHE_MAX  256
+#endif
+#ifndef TCACHE_LEN
+#define TCACHE_LEN  32
+#endif
+#ifndef MM_ARENAS
+#define MM_ARENAS   1
+#endif
+
+#if MM_ARENAS > 1 && !MM_THREADS
+#error "MM_ARENAS needs MM_THREADS"
+#endif
+#if MM_ARENAS > MEM_MAX_SEGS
+#error "MM_ARENAS is more than memlib has segments for"
+#endif
+
+//
+// -DFINE_LOCKS=1 (with MM_THREADS, "make mdriver-fine") replaces the
+// heap lock with a lock per segregated list and a growth lock for the
+// wilderness, the epilogue and the brk, so threads only wait for each
+// other on the same size class or when both carve from the top of the
+// heap. Freeing a block takes the locks of the lists its neighbours are
+// on and of the list it goes to, in bin order. It works on the plain
+// lists only: LIFO and first fit, no MM_SPLIT or MM_PURGE, and none of
+// MM_ARENAS, TLSF, TREE_MIN, QUICK_MAX or SLAB_MAX.
+//
+#ifndef FINE_LOCKS
+#define FINE_LOCKS  0
+#endif
+
+#if FINE_LOCKS && (!MM_THREADS || MM_ARENAS > 1 || TLSF || TREE_MIN || QUICK_MAX || SLAB_MAX)
+#error "FINE_LOCKS needs MM_THREADS and the plain segregated lists"
+#endif
+#if FINE_LOCKS && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "FINE_LOCKS reads a footer and the next header as one doubleword"
+#endif
+
+#if MM_THREADS
+#include <pthread.h>
+#endif
 
 
 
@@ -67,6 +264,10 @@ static inline int MAX(int x, int y) {
   return x > y ? x : y;
 }
 
+static inline int MIN(int x, int y) {
+  return x < y ? x : y;
+}
+
 //
 // Pack a size and allocated bit into a word
 // We mask of the "alloc" field to insure only
@@ -126,6 +327,142 @@ static inline int GET_ALLOC( void *p  ) {
 
 // static char *heap_listp;  /* pointer to first block */
 
+// The state of one heap. Every function below works on the arena ar,
+// which without MM_ARENAS is the only one and a constant address.
+typedef struct arena {
+  // The wilderness: the free block at the top of the heap, if any. It
+  // is kept off the free lists so that it is only carved from when
+  // nothing else fits, and it absorbs blocks freed next to it.
+  struct header *wild;
+
+  // Start of the arena's segment, NULL until the arena is set up; list
+  // and tree links are stored as 32-bit offsets from here, which is
+  // enough for any heap under 4 GB
+  char *heap_base;
+
+  // Next fit resumes its search of list rover_bin at rover, which is a
+  // free block on that list or its sentinel
+  struct header *rover;
+#if TLSF
+  uint32_t fl_bitmap;              // bit fl set if any sl_bitmap[fl]
+  uint32_t sl_bitmap[FL_COUNT];    // bit sl set if that bin is non-empty
+#else
+  int rover_bin;
+
+  // Address order index, see addr_insert
+  uint32_t addr_last[NBINS][ADDR_PAGES];
+  uint64_t addr_map[NBINS][ADDR_WORDS];
+  uint64_t addr_sum[NBINS][(ADDR_WORDS + 63) / 64];
+  uint32_t addr_hi;                // highest page ever indexed
+#endif
+#if TREE_MIN
+  uint32_t tree_root;              // offset of the treap's root, 0 if empty
+#endif
+#if QUICK_MAX && MM_THREADS
+  // Quick stack heads, each a heap offset (0 is empty) in the low word
+  // and a tag bumped by every push and pop in the high word, and their
+  // lengths; QUICK_MAX / DSIZE bounds QUICK_CLASSES
+  uint64_t quick_head[QUICK_MAX / DSIZE];
+  uint32_t quick_len[QUICK_MAX / DSIZE];
+#elif QUICK_MAX
+  // Quick list heads as heap offsets (0 is empty), their lengths and a
+  // bit per non-empty list; QUICK_MAX / DSIZE bounds QUICK_CLASSES
+  uint32_t quick_head[QUICK_MAX / DSIZE];
+  uint32_t quick_len[QUICK_MAX / DSIZE];
+  uint64_t quick_map[(QUICK_MAX / DSIZE + 63) / 64];
+#endif
+#if SLAB_MAX
+  uint32_t run_avail[RUN_CLASSES];     // runs with free slots
+  uint32_t run_map[HEAP_PAGES / 32];   // pages that are runs
+  uint32_t run_map_hi;                 // highest page ever marked
+#endif
+#if PURGE_MIN
+  // Calls to mm_malloc and mm_free on this arena, counted from 1 while
+  // purging is on, and the reading at which its free blocks are next
+  // checked
+  uint32_t mm_clock;
+  uint32_t purge_due;
+#endif
+#if MM_THREADS
+  pthread_mutex_t lock;            // held by every call into the arena
+#endif
+#if FINE_LOCKS
+  // Instead of lock: one per bin, then the growth lock at NBINS, each
+  // on a cache line of its own, and a bit per bin that may be non-empty
+  struct {
+    pthread_mutex_t m;
+  } __attribute__((aligned(64))) bin_lock[NBINS + 1];
+  uint32_t bin_map;
+#endif
+#if MM_ARENAS > 1
+  // Blocks freed by threads of other arenas, linked through their first
+  // payload word. On a cache line of its own, so pushes from other
+  // threads do not keep taking the line with the lock.
+  void *remote __attribute__((aligned(64)));
+#endif
+} arena_t;
+
+#if MM_THREADS
+static arena_t arenas[MM_ARENAS] = {
+  [0 ... MM_ARENAS - 1] = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#if FINE_LOCKS
+    .bin_lock = { [0 ... NBINS] = { PTHREAD_MUTEX_INITIALIZER } },
+#endif
+  }
+};
+#else
+static arena_t arenas[MM_ARENAS];
+#endif
+
+#if MM_ARENAS > 1
+static __thread arena_t *ar;    // the arena this thread is working in
+static unsigned next_arena;     // the next thread to call mm_malloc gets this
+#else
+#define ar (&arenas[0])
+#endif
+
+// Index of ar, which is also the memlib segment its heap lives in
+#define SEG         ((int)(ar - arenas))
+
+// Requests of at least this many bytes are placed at the high end
+static uint32_t split_high;
+
+// Free blocks looked at by find_fit, and calls to mm_malloc, since
+// mm_init (read by mdriver). With several arenas only arena 0's are
+// counted, under its lock, and with FINE_LOCKS there is no lock to
+// count under.
+unsigned long mm_scanned, mm_mallocs;
+
+static inline int counting(void) {
+  return !FINE_LOCKS && ar == &arenas[0];
+}
+
+// Lock acquisitions since mm_init that found the lock held: of the heap
+// or list locks, and of the FINE_LOCKS growth lock (read by mdriver -T)
+unsigned long mm_lock_waits, mm_grow_waits;
+
+// Lets mdriver -T refuse builds without MM_THREADS
+const int mm_thread_safe = MM_THREADS;
+
+// Lets mdriver give memlib a segment per arena
+const int mm_arenas = MM_ARENAS;
+
+#if PURGE_MIN
+// Ticks of an arena's clock a large block must stay free to be purged
+static uint32_t purge_age;
+
+// A large free block's stamp is the word after its list or tree links,
+// the clock reading when it was freed or 0 once its pages are purged
+#define STAMP(bp)   (((uint32_t *)(bp))[4])
+#define STAMP_END   (5 * WSIZE)
+#endif
+
+#if MM_THREADS
+// Bumped by every mm_init
+static unsigned heap_gen;
+#endif
+
 //
 // function prototypes for internal helper routines
 //
@@ -138,373 +475,2310 @@ typedef struct header blockHdr;
 
 // Free list header structure
 struct header {
-  // Contains size of block, and allocated bit
-  size_t size;
-  blockHdr *next;
-  blockHdr *prev;
+  // Contains size of block, prev-allocated and allocated bits
+  uint32_t size;
+  // Heap offsets of the next and previous free blocks
+  uint32_t next;
+  uint32_t prev;
 };
 
+//
+// Convert between block pointers and their 32-bit heap offsets
+//
+static inline uint32_t OFF(void *bp) {
+  return (uint32_t)((char *)bp - ar->heap_base);
+}
+
+static inline void *PTR(uint32_t off) {
+  return ar->heap_base + off;
+}
+
+static inline blockHdr *NEXT_FREE(blockHdr *bp) {
+  return PTR(bp->next);
+}
+
+static inline blockHdr *PREV_FREE(blockHdr *bp) {
+  return PTR(bp->prev);
+}
+
 static void push(blockHdr *bp, blockHdr *newbp)
 {
   newbp->next = bp->next;
-  newbp->prev = bp;
-  bp->next = newbp;
-  newbp->next->prev = newbp;
+  newbp->prev = OFF(bp);
+  bp->next = OFF(newbp);
+  NEXT_FREE(newbp)->prev = OFF(newbp);
 }
 
 static void pop(blockHdr *bp)
 {
-  bp->prev->next = bp->next;
-  bp->next->prev = bp->prev;
-  bp->next = NULL;
-  bp->prev = NULL;
+  // Keep the next fit rover on the list
+  if (bp == ar->rover)
+    ar->rover = NEXT_FREE(bp);
+  PREV_FREE(bp)->next = bp->next;
+  NEXT_FREE(bp)->prev = bp->prev;
+  bp->next = 0;
+  bp->prev = 0;
 }
 
-//
-// function prototypes for internal helper routines
-//
-static void *find_fit(uint32_t asize);
-static blockHdr *PREV_BLKP(blockHdr *bp);
-static blockHdr *NEXT_BLKP(blockHdr *bp);
-static int GET_NEXT_ALLOC(blockHdr *bp);
-// static int GET_PREV_ALLOC(blockHdr *bp);
-void extend_blk(blockHdr *bp, size_t size);
-void endf();
-void ph(int x);
-void ps();
-void fl();
-void sb(blockHdr *bp);
-static void *coalesce(blockHdr *bp);
-static void place(blockHdr *bp, uint32_t asize);
-
-//  single word (4) or double word (8) alignment
-#define ALIGNMENT 8
-
-// Rounds up to the nearest multiple of ALIGNMENT
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
-
-#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
-
-#define BLK_HDR_SIZE ALIGN(sizeof(blockHdr))
-
-#define BLK_FTR_SIZE ALIGN(sizeof(void *))
+typedef struct tnode treeNode;
 
+// Tree node structure, overlaid on the payload of a large free block.
+// Links are heap offsets, 0 meaning none (offset 0 is never a block).
+struct tnode {
+  // Contains size of block, prev-allocated and allocated bits
+  uint32_t size;
+  uint32_t left;
+  uint32_t right;
+  uint32_t parent;
+};
 
+#if TREE_MIN
 //
-// Given block ptr bp, compute address of its header and footer
+// Size-ordered Cartesian tree (treap)
+//
+// Nodes are ordered by (size, address) and heap-ordered on a hash of
+// their address, which keeps the expected depth logarithmic without
+// storing any balance information in the block.
 //
-static inline void *HDRP(blockHdr *bp) {
-  return ((char *)(bp));
-}
-static inline void *FTRP(blockHdr *bp) {
-  return ((char *)(bp) + (bp->size &~1));
-  // return ((char *)(bp) + (bp->size));
-}
 
-// Sets the size and allocation values in a footer at the end of the block
-static inline void SET_FTR(blockHdr *bp, int alloc) {
-  PUT(FTRP(bp), PACK(bp->size, alloc));
+static inline treeNode *NODE(uint32_t off) {
+  return off ? PTR(off) : NULL;
 }
 
-// This function needs to return only if not the begining of the heap
-static inline void *GET_PREV_FTR(blockHdr *bp) {
-  return (void *)bp - BLK_FTR_SIZE;
+static inline int tree_less(treeNode *a, treeNode *b) {
+  uint32_t sa = a->size & ~0x7, sb = b->size & ~0x7;
+  return sa < sb || (sa == sb && a < b);
 }
 
-static inline int GET_PREV_ALLOC(blockHdr *bp) {
-  return GET_ALLOC(GET_PREV_FTR(bp));
+static inline uint32_t tree_prio(uint32_t n) {
+  return n * 2654435761u;
 }
 
-// static inline int GET_NEXT_ALLOC(blockHdr *bp) {
-//   return NEXT_BLKP(bp)->size&1;
-// }
+// Point whatever referenced old (parent or root) at new instead
+static void tree_replace(uint32_t parent, uint32_t old, uint32_t new)
+{
+  treeNode *p = NODE(parent);
+  if (p == NULL)
+    ar->tree_root = new;
+  else if (p->left == old)
+    p->left = new;
+  else
+    p->right = new;
+  if (new != 0)
+    NODE(new)->parent = parent;
+}
 
-// Returns true if next block is marked allocated
-static int GET_NEXT_ALLOC(blockHdr *bp) {
-  if (NEXT_BLKP(bp) == NULL) {
-    return 1;
+// Rotate n up above its parent
+static void tree_rotate_up(uint32_t n)
+{
+  treeNode *np = NODE(n);
+  uint32_t p = np->parent;
+  treeNode *pp = NODE(p);
+  tree_replace(pp->parent, p, n);
+  if (pp->left == n) {
+    pp->left = np->right;
+    if (np->right != 0)
+      NODE(np->right)->parent = p;
+    np->right = p;
   }
-  else
-    return NEXT_BLKP(bp)->size&1;
+  else {
+    pp->right = np->left;
+    if (np->left != 0)
+      NODE(np->left)->parent = p;
+    np->left = p;
+  }
+  pp->parent = n;
 }
 
-// Returns a blockHdr pointer to the header of the previous block in memory
-static blockHdr *PREV_BLKP(blockHdr *bp)
+static void tree_insert(treeNode *np)
 {
-  // At least the second block on the heap (avoids seg fault)
-  if (bp != mem_heap_lo()) {
-    // Pointer to the footer of the previous block in memory
-    void *pftr = (void *)bp - BLK_FTR_SIZE;
-    return (pftr - GET_SIZE(pftr));
+  uint32_t n = OFF(np), p = 0;
+  uint32_t *link = &ar->tree_root;
+  while (*link != 0) {
+    p = *link;
+    link = tree_less(np, NODE(p)) ? &NODE(p)->left : &NODE(p)->right;
   }
-  // Begining of heap
-  else
-    return NULL;
+  np->left = 0;
+  np->right = 0;
+  np->parent = p;
+  *link = n;
+  while (np->parent != 0 && tree_prio(n) > tree_prio(np->parent))
+    tree_rotate_up(n);
 }
 
-// Returns a blockHdr pointer to the header of the next block in memory
-static blockHdr *NEXT_BLKP(blockHdr *bp)
+static void tree_remove(treeNode *np)
 {
-  // This should prevent function from pointing past the end of the heap, but...
-  if ((FTRP(bp) + BLK_FTR_SIZE) <= mem_heap_hi()) {
-    // Cast to char* so that the arithemetic works, then cast back to blockHdr* for return
-    return (blockHdr *)((char *)(bp) + (bp->size&~1) + BLK_FTR_SIZE);
+  uint32_t n = OFF(np), c;
+  // Rotate n down to a leaf, keeping the higher priority child on top
+  while (np->left != 0 || np->right != 0) {
+    if (np->right == 0 ||
+        (np->left != 0 && tree_prio(np->left) > tree_prio(np->right)))
+      c = np->left;
+    else
+      c = np->right;
+    tree_rotate_up(c);
   }
-  // End of heap
-  else
-    return NULL;
+  tree_replace(np->parent, n, 0);
 }
 
-// Extend the size of block at bp to its original size, plus argument 'size'
-void extend_blk(blockHdr *bp, size_t size)
+// Smallest block of at least asize bytes, or NULL
+static treeNode *tree_best_fit(uint32_t asize)
 {
-  bp->size += size;
-  // SET_FTR(bp, bp->size&~1);
-  SET_FTR(bp, GET_ALLOC(bp));
+  treeNode *n = NODE(ar->tree_root), *best = NULL;
+  while (n != NULL) {
+    if (counting())
+      mm_scanned++;
+    if ((n->size & ~0x7) >= asize) {
+      best = n;
+      n = NODE(n->left);
+    }
+    else
+      n = NODE(n->right);
+  }
+  return best;
 }
+#endif
 
 //
-// mm_init - Initialize the memory manager
+// Segregated free lists
 //
-int mm_init(void)
-{
-  // Create root node for empty free list
-  blockHdr *bp = mem_sbrk(BLK_HDR_SIZE + BLK_FTR_SIZE);
-  // bp->size = BLK_HDR_SIZE | 1;
-  bp->size = PACK(BLK_HDR_SIZE, 1);
-  bp->next = bp;
-  bp->prev = bp;
-  SET_FTR(bp, 1);
-  return 0;
+// The prologue block at mem_heap_lo() is an array of NBINS sentinel
+// headers, one circular list per size class. Sizes below SMALL_LIMIT
+// get a bin per 16 bytes, everything above that is binned by its
+// power of two.
+//
+static inline blockHdr *BIN(int i) {
+  return (blockHdr *)(ar->heap_base + WSIZE) + i;
 }
 
+#if TLSF
 //
-// Test routines
+// With TLSF the bins are numbered fl * SL_COUNT + sl. First level 0
+// covers the sizes below SMALL_LIMIT in 16 byte steps, first level
+// n > 0 covers [2^(n+6), 2^(n+7)) in SL_COUNT equal steps.
 //
-void endf()
+
+static inline int bin_index(size_t size)
 {
-  // blockHdr *bp = mem_heap_lo();
-  // while (bp < (blockHdr *)mem_heap_hi()){
-  //   printf("end of block %p\n", (FTRP(bp) + BLK_FTR_SIZE));
-  //   bp = (blockHdr *)((char *)bp +(bp->size & ~1) + BLK_FTR_SIZE);
-  // }
-  printf("End of heap %p\n", (void *)mem_heap_hi());
+  int fl, sl;
+  if (size < SMALL_LIMIT)
+    return size >> 4;
+  fl = 31 - __builtin_clz((uint32_t)size);
+  sl = (size >> (fl - SL_BITS)) & (SL_COUNT - 1);
+  fl -= 6;
+  if (fl >= FL_COUNT)
+    return NBINS - 1;
+  return fl * SL_COUNT + sl;
 }
 
-void ps()
+// Push a free block onto its bin and mark the bin non-empty
+static inline void bin_insert(blockHdr *bp)
 {
-  printf("%d\n", (int)BLK_FTR_SIZE);
+  int i = bin_index(bp->size & ~0x7);
+  push(BIN(i), bp);
+  ar->fl_bitmap |= 1u << (i / SL_COUNT);
+  ar->sl_bitmap[i / SL_COUNT] |= 1u << (i % SL_COUNT);
 }
 
-void ph(int x)
+// Unlink a free block, clearing the bitmaps if its bin became empty
+static inline void bin_remove(blockHdr *bp)
 {
-  blockHdr *bp = mem_heap_lo();
-  bp = (blockHdr *)((char *)bp +(bp->size & ~1) + BLK_FTR_SIZE);
-  while (bp < (blockHdr *)mem_heap_hi()) {
-    printf("%s block at %p, size %d\n",
-      GET_ALLOC(FTRP(bp))?"allocated":"free", bp, GET_SIZE(FTRP(bp))-DSIZE);
-    if (x == 1)
-      printf("next block is at %p\n", NEXT_BLKP(bp));
-    else if (x == 2)
-      printf("next block is %s\n", GET_NEXT_ALLOC(bp)?"allocated":"free");
-    else if (x == 3)
-      printf("footer is at %p\n", FTRP(bp));
-    else if (x == 4)
-      printf("previous block is at %p\n", PREV_BLKP(bp));
-    bp = (blockHdr *)((char *)bp +(bp->size & ~1) + BLK_FTR_SIZE);
+  int i;
+  if (bp->next == bp->prev && NEXT_FREE(bp) == BIN(i = bin_index(bp->size & ~0x7))) {
+    ar->sl_bitmap[i / SL_COUNT] &= ~(1u << (i % SL_COUNT));
+    if (ar->sl_bitmap[i / SL_COUNT] == 0)
+      ar->fl_bitmap &= ~(1u << (i / SL_COUNT));
   }
-  printf("----------------------------------------------------\n");
+  pop(bp);
+}
+#else
+static inline int bin_index(size_t size)
+{
+  int i;
+  if (size < SMALL_LIMIT)
+    return size >> 4;
+  // floor(log2(size)), offset so that SMALL_LIMIT maps to SMALL_BINS
+  i = SMALL_BINS + (31 - __builtin_clz((uint32_t)size)) - 7;
+  return i < NBINS ? i : NBINS - 1;
 }
 
-void fl()
+static int list_order;
+static int fit_mode;
+static int fit_k;
+
+//
+// Address order index. The heap is cut into ADDR_PAGES pages, at least
+// 2^ADDR_SHIFT bytes each and large enough to cover mem_maxheap(). For
+// each bin addr_last holds its highest block starting in each page,
+// with a bit in addr_map (and a summary bit per word of addr_map in
+// addr_sum) for the pages that have one. An insertion only walks the
+// bin's blocks in its own page, or jumps to the last block of the
+// nearest lower page found from the bitmaps.
+//
+static int addr_shift;                  // log2 of the page size
+
+static inline uint32_t ADDR_PG(blockHdr *bp) {
+  return OFF(bp) >> addr_shift;
+}
+
+// Forget every page, the heap they indexed has been reset
+static void addr_reset(void)
 {
-  blockHdr *bp;
-  for (bp = ((blockHdr *)mem_heap_lo())->next;
-       bp != mem_heap_lo();
-       bp = bp->next) {
-    printf("%s block at %p, size %d\n",
-      GET_ALLOC(FTRP(bp))?"allocated":"free", bp, 1);
+  int i;
+  for (i = 0; i < NBINS; i++) {
+    memset(ar->addr_last[i], 0, (ar->addr_hi + 1) * sizeof(uint32_t));
+    memset(ar->addr_map[i], 0, (ar->addr_hi / 64 + 1) * sizeof(uint64_t));
+    memset(ar->addr_sum[i], 0, sizeof(ar->addr_sum[i]));
   }
+  ar->addr_hi = 0;
 }
 
-void sb(blockHdr *bp)
+static inline void addr_mark(int i, uint32_t pg)
 {
-  printf("%s block at %p, size %d\n",
-      (bp->size&1)?"allocated":"free", bp, (int)(bp->size)-DSIZE);
+  ar->addr_map[i][pg / 64] |= 1ull << (pg % 64);
+  ar->addr_sum[i][pg / 4096] |= 1ull << (pg / 64 % 64);
+  if (pg > ar->addr_hi)
+    ar->addr_hi = pg;
 }
 
-//
-// mm_malloc - Allocate a block with at least size bytes of payload
-//
-void *mm_malloc(uint32_t size)
+static inline void addr_clear(int i, uint32_t pg)
 {
-  // ph(0);
-  // new block size is header + requested size
-  int newsize = ALIGN(DSIZE + size);
-  // Call find_fit to request existing block of newsize
-  blockHdr *bp = find_fit(newsize);
+  if ((ar->addr_map[i][pg / 64] &= ~(1ull << (pg % 64))) == 0)
+    ar->addr_sum[i][pg / 4096] &= ~(1ull << (pg / 64 % 64));
+}
 
-  // Did not find block of appropriate size in free list
-  if (bp == NULL) {
-    // Initialize a new block
-    bp = mem_sbrk(newsize + BLK_FTR_SIZE);
-    // Space unavailable
-    if ((long)bp == -1) {
-      return NULL;
-    }
-    // Assign block size and set to allocated
-    else {
-      bp->size = newsize | 1;
-      SET_FTR(bp, 1);
-    }
+// Highest page below pg holding a block of bin i, or -1
+static int addr_below(int i, uint32_t pg)
+{
+  int w = pg / 64, s;
+  uint64_t m = ar->addr_map[i][w] & ((1ull << (pg % 64)) - 1);
+
+  if (m == 0) {
+    // Find the highest non-empty map word below w from the summary
+    for (s = w / 64, m = ar->addr_sum[i][s] & ((1ull << (w % 64)) - 1);
+         m == 0; m = ar->addr_sum[i][s])
+      if (--s < 0)
+        return -1;
+    w = s * 64 + 63 - __builtin_clzll(m);
+    m = ar->addr_map[i][w];
+  }
+  return w * 64 + 63 - __builtin_clzll(m);
+}
+
+static void addr_insert(int i, blockHdr *bp)
+{
+  uint32_t pg = ADDR_PG(bp);
+  blockHdr *at;
+  int below;
+
+  if (ar->addr_last[i][pg] != 0) {
+    at = PTR(ar->addr_last[i][pg]);
+    if (at < bp)
+      ar->addr_last[i][pg] = OFF(bp);
+    else
+      // The sentinel sits below every block, so this stops at it
+      while ((at = PREV_FREE(at)) > bp)
+        ;
   }
-  // Found a fit on the free list
   else {
-    place(bp, size);
-    // // Mark as allocated
-    // bp->size |= 1;
-    // SET_FTR(bp, 1);
-    // // Remove from free list
-    // pop(bp);
+    below = addr_below(i, pg);
+    at = below < 0 ? BIN(i) : PTR(ar->addr_last[i][below]);
+    ar->addr_last[i][pg] = OFF(bp);
+    addr_mark(i, pg);
   }
-  // Return pointer to the payload
-  return (char *)bp + DSIZE;
+  push(at, bp);
 }
 
-static void place(blockHdr *bp, uint32_t asize)
+static void addr_remove(int i, blockHdr *bp)
 {
-  // Get free list head pointer
-  blockHdr *head = mem_heap_lo();
-  size_t csize = GET_SIZE(FTRP(bp));
-  // new block size is header + requested size
-  int newsize = ALIGN(DSIZE + asize);
-  int splitsize = ALIGN(csize - newsize - BLK_FTR_SIZE);
+  uint32_t pg = ADDR_PG(bp);
+  blockHdr *prev = PREV_FREE(bp);
 
-  if ((csize - asize) >= FOVERHEAD && splitsize >= FOVERHEAD + 1) {
-    // Remove bp from free list
-    pop(bp);
-    // Shrink bp to newsize and allocate
-    bp->size = newsize | 1;
-    SET_FTR(bp, 1);
-    // Setup new block
-    bp = NEXT_BLKP(bp);
-    bp->size = splitsize | 0;
-    SET_FTR(bp, 0);
-    // Push new block onto free list
-    push(head, bp);
-  }
-  else {
-    // Mark as allocated
-    bp->size |= 1;
-    SET_FTR(bp, 1);
-    // Remove from free list
-    pop(bp);
+  if (ar->addr_last[i][pg] == OFF(bp)) {
+    if (prev != BIN(i) && ADDR_PG(prev) == pg)
+      ar->addr_last[i][pg] = OFF(prev);
+    else {
+      ar->addr_last[i][pg] = 0;
+      addr_clear(i, pg);
+    }
   }
+  pop(bp);
 }
 
-//
-// find_fit - Find a fit for a block with asize bytes
-//
-static void *find_fit(uint32_t asize)
+// Insert before the first block on the list that is at least as large
+static void size_insert(int i, blockHdr *bp)
 {
-  blockHdr *bp;
-  // Iterate through free list until end or find block of requested size
-  for (bp = ((blockHdr *)mem_heap_lo())->next;
-       bp != mem_heap_lo() && bp->size < asize;
-       bp = bp->next);
-  // Loop terminates either at a block of requested size, or at begining of free list, if there is no block of requested size
-
-  // Loop has found an appropriate block on the free list <<?>>
-  if (bp != mem_heap_lo())
-    return bp;
-  // There is no appropriate block on the free list
-  // calling function must initialize new block <<?>>
-  else
-    return NULL;
+  blockHdr *at = BIN(i);
+  size_t size = bp->size & ~0x7;
+
+  while (NEXT_FREE(at) != BIN(i) && (NEXT_FREE(at)->size & ~0x7) < size)
+    at = NEXT_FREE(at);
+  push(at, bp);
 }
 
+// Put a free block on the list for its size class
+static inline void bin_insert(blockHdr *bp)
+{
+  int i = bin_index(bp->size & ~0x7);
+#if TREE_MIN
+  if ((bp->size & ~0x7) >= TREE_MIN) {
+    tree_insert((treeNode *)bp);
+    return;
+  }
+#endif
+  if (list_order == ORDER_ADDR)
+    addr_insert(i, bp);
+  else if (list_order == ORDER_SIZE)
+    size_insert(i, bp);
+  else
+    push(BIN(i), bp);
+}
 
-//
-// mm_free - Free a block
-//
-// ptr is a pointer to the payload of the block we want to free
-void mm_free(void *ptr)
+// Unlink a free block from whichever list (or the tree) it is on
+static inline void bin_remove(blockHdr *bp)
 {
-  blockHdr *bp = ptr-DSIZE;
-  // blockHdr *head = mem_heap_lo();   // Head of free list
-  // Mark as unallocated
-  bp->size &= ~1;
-  SET_FTR(bp, 0);
-  // Add block to the front of the free list
-  // push(head, bp);
-  coalesce(bp);
+#if TREE_MIN
+  if ((bp->size & ~0x7) >= TREE_MIN) {
+    tree_remove((treeNode *)bp);
+    return;
+  }
+#endif
+  if (list_order == ORDER_ADDR)
+    addr_remove(bin_index(bp->size & ~0x7), bp);
+  else
+    pop(bp);
 }
+#endif
 
 //
-// mm_realloc -- llist implementation
+// function prototypes for internal helper routines
 //
-void *mm_realloc(void *ptr, uint32_t size)
-{
-  blockHdr *bp = ptr-BLK_HDR_SIZE;
-  void *newptr = mm_malloc(size);
-  // Ignore spurious input
-  if (newptr == NULL)
-    return NULL;
-  int copySize = bp->size-BLK_HDR_SIZE;
-  if (size < copySize)
-    copySize = size;
-  memcpy(newptr, ptr, copySize);
-  mm_free(ptr);
-  return newptr;
-}
+static inline blockHdr *PREV_BLKP(blockHdr *bp);
+static inline blockHdr *NEXT_BLKP(blockHdr *bp);
+static blockHdr *extend_heap(size_t size);
+static blockHdr *grow_wild(size_t need);
+void extend_blk(blockHdr *bp, size_t size);
+void endf();
+void ph(int x);
+void ps();
+void fl();
+void sb(blockHdr *bp);
+static blockHdr *coalesce(blockHdr *bp);
+static void split_blk(blockHdr *bp, size_t newsize);
+static void *heap_malloc(uint32_t size);
+static void heap_free(void *ptr);
+static void *heap_realloc(void *ptr, uint32_t size);
+#if FINE_LOCKS
+static blockHdr *fine_alloc(size_t asize);
+static int fine_grow(blockHdr *bp, size_t asize);
+static void fine_free(blockHdr *bp);
+#else
+static void *find_fit(uint32_t asize);
+static blockHdr *get_free(size_t asize);
+static blockHdr *place(blockHdr *bp, uint32_t asize);
+static void blk_free(blockHdr *bp);
+#endif
+#if QUICK_MAX
+static void quick_reset(void);
+static int quick_flush(void);
+#endif
+#if SLAB_MAX
+static inline int is_run_obj(void *ptr);
+static void *run_alloc(uint32_t size);
+static void run_free(void *ptr);
+static size_t run_obj_size(void *ptr);
+static void run_reset(void);
+#endif
+
+//  single word (4) or double word (8) alignment
+#define ALIGNMENT 8
+
+// Rounds up to the nearest multiple of ALIGNMENT
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+
+#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+
+// One word header in front of every payload, one word footer at the
+// end of every free block
+#define BLK_HDR_SIZE WSIZE
+
+#define BLK_FTR_SIZE WSIZE
+
+// Smallest block that can hold the list links and a footer once free
+#define MIN_BLK_SIZE ALIGN(sizeof(blockHdr) + BLK_FTR_SIZE)
+
+// The prologue block is the array of list roots
+#define PROLOGUE_SIZE ALIGN(NBINS * sizeof(blockHdr))
+
+// Header bit set when the block before this one is allocated
+#define PREV_ALLOC  0x2
+
+// A tree node (16 bytes) and a footer must fit in the smallest tree block
+#if TREE_MIN && TREE_MIN < 24
+#error "TREE_MIN is too small to hold a tree node and a footer"
+#endif
 
 //
-// coalesce - boundary tag coalescing. Return ptr to coalesced block
+// Header fields of block bp. With FINE_LOCKS a header can change under
+// a lock other than the reader's, so every access to it is atomic.
 //
-static void *coalesce(blockHdr *bp)
-{
-  blockHdr *head = mem_heap_lo();
-  blockHdr *nextb = NEXT_BLKP(bp);
-  // blockHdr *prevb = PREV_BLKP(bp);
+static inline uint32_t HDR_WORD(blockHdr *bp) {
+#if FINE_LOCKS
+  return __atomic_load_n(&bp->size, __ATOMIC_RELAXED);
+#else
+  return bp->size;
+#endif
+}
 
-  // Case 1: prev and next allocated
-  if (GET_NEXT_ALLOC(bp) && GET_PREV_ALLOC(bp)) {
-    push(head, bp);
-    return bp;
-  }
+static inline size_t BLK_SIZE(blockHdr *bp) {
+  return HDR_WORD(bp) & ~0x7;
+}
 
-  // Case 2: prev allocated, next free
-  if (!GET_NEXT_ALLOC(bp) && GET_PREV_ALLOC(bp)) {
-    // printf("case 2\n");
-    extend_blk(bp, (NEXT_BLKP(bp)->size + BLK_FTR_SIZE));
-    push(head, bp);
-    pop(nextb);
-    return bp;
-  }
+static inline int IS_ALLOC(blockHdr *bp) {
+  return HDR_WORD(bp) & 0x1;
+}
 
-  // Case 3: prev free, next allocated
-  if (GET_NEXT_ALLOC(bp) && !GET_PREV_ALLOC(bp)) {
-    // printf("case 3\n");
-    bp = PREV_BLKP(bp);
-    extend_blk(bp, (NEXT_BLKP(bp)->size + BLK_FTR_SIZE));
-    return bp;
-  }
+static inline int GET_PREV_ALLOC(blockHdr *bp) {
+  return HDR_WORD(bp) & PREV_ALLOC;
+}
 
-  // Case 4: next and prev free
-  if (!GET_NEXT_ALLOC(bp) && !GET_PREV_ALLOC(bp)) {
-    pop(nextb);
-    bp = PREV_BLKP(bp);
-    extend_blk(bp, (NEXT_BLKP(bp)->size + BLK_FTR_SIZE));
-    extend_blk(bp, (NEXT_BLKP(bp)->size + BLK_FTR_SIZE));
-    return bp;
-  }
+// Write a header, keeping the prev-allocated bit already in it
+static inline void SET_HDR(blockHdr *bp, size_t size, int alloc) {
+#if FINE_LOCKS
+  uint32_t old = __atomic_load_n(&bp->size, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&bp->size, &old,
+                                      size | (old & PREV_ALLOC) | (alloc & 0x1),
+                                      1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+#else
+  bp->size = size | (bp->size & PREV_ALLOC) | (alloc & 0x1);
+#endif
+}
 
-  return bp;
+// Write the whole header of a block that has none yet, or the epilogue
+static inline void PUT_HDR(blockHdr *bp, uint32_t val) {
+#if FINE_LOCKS
+  __atomic_store_n(&bp->size, val, __ATOMIC_RELAXED);
+#else
+  bp->size = val;
+#endif
+}
+
+// Set or clear the prev-allocated bit of block bp. This is the one
+// write to an allocated block's header, so with MM_THREADS it is atomic
+// for the thread caches, which read their objects' sizes unlocked.
+static inline void SET_PREV_ALLOC(blockHdr *bp, int alloc) {
+#if MM_THREADS
+  if (alloc)
+    __atomic_or_fetch(&bp->size, PREV_ALLOC, __ATOMIC_RELAXED);
+  else
+    __atomic_and_fetch(&bp->size, ~PREV_ALLOC, __ATOMIC_RELAXED);
+#else
+  if (alloc)
+    bp->size |= PREV_ALLOC;
+  else
+    bp->size &= ~PREV_ALLOC;
+#endif
+}
+
+//
+// Given block ptr bp, compute address of its header and footer.
+// Only free blocks have a footer, in their last BLK_FTR_SIZE bytes.
+//
+static inline void *HDRP(blockHdr *bp) {
+  return ((char *)(bp));
+}
+static inline void *FTRP(blockHdr *bp) {
+  return ((char *)(bp) + BLK_SIZE(bp) - BLK_FTR_SIZE);
 }
 
+// Copies the size of a free block into its footer
+static inline void SET_FTR(blockHdr *bp) {
+#if FINE_LOCKS
+  __atomic_store_n((uint32_t *)FTRP(bp), PACK(BLK_SIZE(bp), 0), __ATOMIC_RELAXED);
+#else
+  PUT(FTRP(bp), PACK(BLK_SIZE(bp), 0));
+#endif
+}
 
+// Footer of the previous block; only meaningful if that block is free
+static inline void *GET_PREV_FTR(blockHdr *bp) {
+  return (void *)bp - BLK_FTR_SIZE;
+}
 
+// Returns true if next block is marked allocated
+static inline int GET_NEXT_ALLOC(blockHdr *bp) {
+  return IS_ALLOC(NEXT_BLKP(bp));
+}
 
+// Returns a blockHdr pointer to the header of the previous block in memory.
+// The caller must have checked that it is free, allocated blocks have
+// no footer to find it by.
+static inline blockHdr *PREV_BLKP(blockHdr *bp)
+{
+  return (blockHdr *)((char *)bp - GET_SIZE(GET_PREV_FTR(bp)));
+}
+
+// Returns a blockHdr pointer to the header of the next block in memory.
+// At the end of the heap this is the epilogue, a zero-sized allocated
+// header.
+static inline blockHdr *NEXT_BLKP(blockHdr *bp)
+{
+  return (blockHdr *)((char *)(bp) + BLK_SIZE(bp));
+}
+
+// Extend the size of block at bp to its original size, plus argument 'size'
+void extend_blk(blockHdr *bp, size_t size)
+{
+  bp->size += size;
+  if (!IS_ALLOC(bp))
+    SET_FTR(bp);
+}
+
+//
+// Add and remove free blocks. A free block that ends at the epilogue
+// becomes the wilderness rather than going on a list.
+//
+static inline void insert_free(blockHdr *bp)
+{
+#if PURGE_MIN
+  // Stamp large blocks with the time they became free
+  if (BLK_SIZE(bp) >= PURGE_MIN)
+    STAMP(bp) = ar->mm_clock;
+#endif
+  if (BLK_SIZE(NEXT_BLKP(bp)) == 0)
+    ar->wild = bp;
+  else
+    bin_insert(bp);
+}
+
+static inline void remove_free(blockHdr *bp)
+{
+  if (bp == ar->wild)
+    ar->wild = NULL;
+  else
+    bin_remove(bp);
+}
+
+//
+// extend_heap - Grow the heap by size bytes, turning the old epilogue
+//               into the header of a new free block (not yet on any
+//               list) and writing a new epilogue after it
+//
+static blockHdr *extend_heap(size_t size)
+{
+  char *brk;
+  blockHdr *bp;
+
+  // Offsets are 32 bits, so the heap ends at 4 GB whatever memlib allows
+  if (mem_seg_size(SEG) + size > UINT32_MAX)
+    return NULL;
+  if ((long)(brk = mem_seg_sbrk(SEG, size)) == -1)
+    return NULL;
+  // The new epilogue goes first, so that no header ever reaches past it
+  bp = (blockHdr *)(brk - BLK_HDR_SIZE);
+  PUT_HDR((blockHdr *)(brk + size - BLK_HDR_SIZE), PACK(0, 1));
+  SET_HDR(bp, size, 0);
+  SET_FTR(bp);
+  return bp;
+}
+
+//
+// grow_wild - Make the wilderness at least need bytes larger, growing
+//             the heap by at least CHUNKSIZE so sbrk is called rarely
+//
+static blockHdr *grow_wild(size_t need)
+{
+  blockHdr *bp;
+
+#if FINE_LOCKS
+  // fine_free reads the wilderness unlocked, so it is grown with one
+  // header write instead of being merged with a new block
+  if ((bp = ar->wild) != NULL) {
+    size_t size = MAX(ALIGN(need), CHUNKSIZE);
+    if (mem_seg_size(SEG) + size > UINT32_MAX ||
+        mem_seg_sbrk(SEG, size) == (void *)-1)
+      return NULL;
+    PUT_HDR((blockHdr *)((char *)NEXT_BLKP(bp) + size), PACK(0, 1));
+    SET_HDR(bp, BLK_SIZE(bp) + size, 0);
+    SET_FTR(bp);
+    return bp;
+  }
+#endif
+  bp = extend_heap(MAX(ALIGN(need), CHUNKSIZE));
+  if (bp == NULL)
+    return NULL;
+  // Merges with the old wilderness and becomes the new one
+  return coalesce(bp);
+}
+
+#if TRIM_MIN
+//
+// trim_wild - Cut a wilderness of at least TRIM_MIN bytes back to
+//             CHUNKSIZE, moving the epilogue down and the brk with it
+//
+static void trim_wild(void)
+{
+  size_t size = BLK_SIZE(ar->wild);
+
+  if (size < TRIM_MIN || mem_seg_sbrk(SEG, -(int)(size - CHUNKSIZE)) == (void *)-1)
+    return;
+  PUT_HDR((blockHdr *)((char *)ar->wild + CHUNKSIZE), PACK(0, 1));
+  SET_HDR(ar->wild, CHUNKSIZE, 0);
+  SET_FTR(ar->wild);
+}
+#endif
+
+#if PURGE_MIN
+//
+// purge_blk - Purge the pages of free block bp, keeping its header,
+//             links, stamp and footer, if it has been free long enough
+//
+static void purge_blk(blockHdr *bp)
+{
+  if (STAMP(bp) == 0 || ar->mm_clock - STAMP(bp) < purge_age)
+    return;
+  mem_purge((char *)bp + STAMP_END, BLK_SIZE(bp) - STAMP_END - BLK_FTR_SIZE);
+  STAMP(bp) = 0;
+}
+
+#if TREE_MIN
+static void purge_tree(uint32_t off)
+{
+  treeNode *np = NODE(off);
+  if (np == NULL)
+    return;
+  purge_blk((blockHdr *)np);
+  purge_tree(np->left);
+  purge_tree(np->right);
+}
+#endif
+
+//
+// purge_scan - Purge every large free block that has been free for
+//              purge_age ticks. It runs every purge_age / 2 ticks, so
+//              a block is purged at most 1.5 purge_age ticks after it
+//              was freed.
+//
+static void purge_scan(void)
+{
+  blockHdr *bp;
+  int i;
+
+  ar->purge_due = ar->mm_clock + MAX(purge_age / 2, 1);
+  for (i = bin_index(PURGE_MIN); i < NBINS; i++)
+    for (bp = NEXT_FREE(BIN(i)); bp != BIN(i); bp = NEXT_FREE(bp))
+      if (BLK_SIZE(bp) >= PURGE_MIN)
+        purge_blk(bp);
+#if TREE_MIN
+  purge_tree(ar->tree_root);
+#endif
+  if (ar->wild != NULL && BLK_SIZE(ar->wild) >= PURGE_MIN)
+    purge_blk(ar->wild);
+}
+
+// Count a call to mm_malloc or mm_free
+static inline void purge_tick(void)
+{
+  if (purge_age && ++ar->mm_clock == ar->purge_due)
+    purge_scan();
+}
+#endif
+
+//
+// arena_init - Set up an empty heap for arena ar at the bottom of its
+//              segment
+//
+static int arena_init(void)
+{
+  int i;
+  blockHdr *bp;
+  char *base;
+
+#if !TLSF
+  ar->rover = NULL;
+  addr_reset();
+#endif
+  // Create one root node per size class, together forming the prologue,
+  // followed by the epilogue header. The first word is padding so that
+  // payloads, one header word into each block, are doubleword aligned.
+  base = mem_seg_sbrk(SEG, WSIZE + PROLOGUE_SIZE + BLK_HDR_SIZE);
+  if ((long)base == -1)
+    return -1;
+  ar->heap_base = base;
+  bp = BIN(0);
+  for (i = 0; i < NBINS; i++) {
+    bp[i].size = PACK(0, 1);
+    bp[i].next = OFF(&bp[i]);
+    bp[i].prev = OFF(&bp[i]);
+  }
+  bp->size = PACK(PROLOGUE_SIZE, 1) | PREV_ALLOC;
+  NEXT_BLKP(bp)->size = PACK(0, 1) | PREV_ALLOC;
+#if TLSF
+  ar->fl_bitmap = 0;
+  memset(ar->sl_bitmap, 0, sizeof(ar->sl_bitmap));
+#endif
+#if FINE_LOCKS
+  ar->bin_map = 0;
+#endif
+#if TREE_MIN
+  ar->tree_root = 0;
+#endif
+  ar->wild = NULL;
+#if MM_ARENAS > 1
+  ar->remote = NULL;
+#endif
+#if PURGE_MIN
+  ar->mm_clock = 1;
+  ar->purge_due = ar->mm_clock + MAX(purge_age / 2, 1);
+#endif
+#if SLAB_MAX
+  run_reset();
+#endif
+#if QUICK_MAX
+  quick_reset();
+#endif
+  return 0;
+}
+
+//
+// mm_init - Initialize the memory manager. Arena 0 is set up here and
+//           belongs to the calling thread, the others are set up by the
+//           first thread bound to them.
+//
+int mm_init(void)
+{
+  char *order = getenv("MM_ORDER");
+  char *fit = getenv("MM_FIT");
+#if MM_ARENAS > 1
+  int i;
+#endif
+
+#if TLSF
+  if (order != NULL && strcmp(order, "lifo") != 0)
+    return -1;
+  if (fit != NULL && strcmp(fit, "first") != 0)
+    return -1;
+#else
+  if (fit == NULL || strcmp(fit, "first") == 0)
+    fit_mode = FIT_FIRST;
+  else if (strcmp(fit, "next") == 0)
+    fit_mode = FIT_NEXT;
+  else if (strcmp(fit, "good") == 0)
+    fit_mode = FIT_GOOD;
+  else
+    return -1;
+  fit_k = getenv("MM_FIT_K") ? atoi(getenv("MM_FIT_K")) : FIT_K;
+  if (fit_k < 1)
+    return -1;
+  if (order == NULL || strcmp(order, "lifo") == 0)
+    list_order = ORDER_LIFO;
+  else if (strcmp(order, "addr") == 0)
+    list_order = ORDER_ADDR;
+  else if (strcmp(order, "size") == 0)
+    list_order = ORDER_SIZE;
+  else
+    return -1;
+  for (addr_shift = ADDR_SHIFT; (mem_maxheap() - 1) >> addr_shift >= ADDR_PAGES;
+       addr_shift++)
+    ;
+#endif
+  split_high = getenv("MM_SPLIT") ? atoi(getenv("MM_SPLIT")) : SPLIT_HIGH;
+  mm_scanned = mm_mallocs = 0;
+  mm_lock_waits = mm_grow_waits = 0;
+#if MM_THREADS
+  heap_gen++;
+#endif
+#if PURGE_MIN
+  purge_age = getenv("MM_PURGE") ? atoi(getenv("MM_PURGE")) : PURGE_AGE;
+#endif
+#if FINE_LOCKS
+  // Each list's lock covers only its own blocks, which rules out the
+  // orders and fits that keep shared state and the purge scan
+  if (list_order != ORDER_LIFO || fit_mode != FIT_FIRST || split_high)
+    return -1;
+#if PURGE_MIN
+  if (purge_age)
+    return -1;
+#endif
+#endif
+#if MM_ARENAS > 1
+  // Every arena needs a segment of its own (mem_set_segments)
+  if (mem_segments() < MM_ARENAS)
+    return -1;
+  for (i = 1; i < MM_ARENAS; i++) {
+    ar = &arenas[i];
+    ar->heap_base = NULL;
+#if QUICK_MAX
+    // Popped without the lock, before anything sets the arena up
+    quick_reset();
+#endif
+  }
+  ar = &arenas[0];
+  next_arena = 1;
+#endif
+  return arena_init();
+}
+
+//
+// Test routines
+//
+void endf()
+{
+  printf("End of heap %p\n", (void *)mem_heap_hi());
+}
+
+void ps()
+{
+  printf("%d\n", (int)BLK_FTR_SIZE);
+}
+
+void ph(int x)
+{
+  blockHdr *bp = NEXT_BLKP(BIN(0));
+  while (BLK_SIZE(bp) > 0) {
+    printf("%s block at %p, size %d\n",
+      IS_ALLOC(bp)?"allocated":"free", bp, (int)BLK_SIZE(bp));
+    if (x == 1)
+      printf("next block is at %p\n", NEXT_BLKP(bp));
+    else if (x == 2)
+      printf("next block is %s\n", GET_NEXT_ALLOC(bp)?"allocated":"free");
+    else if (x == 3 && !IS_ALLOC(bp))
+      printf("footer is at %p\n", FTRP(bp));
+    else if (x == 4 && !GET_PREV_ALLOC(bp))
+      printf("previous block is at %p\n", PREV_BLKP(bp));
+    bp = NEXT_BLKP(bp);
+  }
+  printf("----------------------------------------------------\n");
+}
+
+void fl()
+{
+  blockHdr *bp;
+  int i;
+  for (i = 0; i < NBINS; i++) {
+    for (bp = NEXT_FREE(BIN(i)); bp != BIN(i); bp = NEXT_FREE(bp)) {
+      printf("bin %d: %s block at %p, size %d\n", i,
+        IS_ALLOC(bp)?"allocated":"free", bp, GET_SIZE(FTRP(bp)));
+    }
+  }
+}
+
+void sb(blockHdr *bp)
+{
+  printf("%s block at %p, size %d\n",
+      IS_ALLOC(bp)?"allocated":"free", bp, (int)BLK_SIZE(bp));
+}
+
+#if QUICK_MAX
+/////////////////////////////////////////////////////////////////////////////
+//
+// Quick lists
+//
+// A block on a quick list keeps its allocated header, so neighbours
+// never coalesce with it, and is linked through the first payload word.
+//
+#define QUICK_CLASSES ((QUICK_MAX - MIN_BLK_SIZE) / DSIZE + 1)
+
+static inline int quick_class(size_t size) {
+  return (size - MIN_BLK_SIZE) / DSIZE;
+}
+
+#if MM_THREADS
+//
+// With MM_THREADS each list is a Treiber stack that threads push and
+// pop without the lock. The tag in the head changes with every push and
+// pop, so a pop that read a head whose block has since been popped and
+// pushed back fails its CAS rather than installing a stale link.
+//
+static void quick_reset(void)
+{
+  memset(ar->quick_head, 0, sizeof(ar->quick_head));
+  memset(ar->quick_len, 0, sizeof(ar->quick_len));
+}
+
+// The link in the block at the top of a stack. Another thread may pop
+// the block and write its payload before this read, but then the CAS
+// that follows fails, so the race is benign and hidden from TSan.
+__attribute__((no_sanitize_thread))
+static uint32_t quick_link(blockHdr *bp) {
+  return bp->next;
+}
+
+static inline blockHdr *quick_pop(size_t size)
+{
+  int i = quick_class(size);
+  uint64_t old = __atomic_load_n(&ar->quick_head[i], __ATOMIC_ACQUIRE), new;
+  blockHdr *bp;
+
+  do {
+    if ((uint32_t)old == 0)
+      return NULL;
+    bp = PTR((uint32_t)old);
+    new = ((old >> 32) + 1) << 32 | quick_link(bp);
+  } while (!__atomic_compare_exchange_n(&ar->quick_head[i], &old, new, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  __atomic_sub_fetch(&ar->quick_len[i], 1, __ATOMIC_RELAXED);
+  return bp;
+}
+
+// Push bp on its stack unless the stack is full, returning 0 if it is
+static inline int quick_push(blockHdr *bp)
+{
+  int i = quick_class(__atomic_load_n(&bp->size, __ATOMIC_RELAXED) & ~0x7);
+  uint64_t old = __atomic_load_n(&ar->quick_head[i], __ATOMIC_RELAXED), new;
+
+  if (__atomic_load_n(&ar->quick_len[i], __ATOMIC_RELAXED) >= QUICK_LEN)
+    return 0;
+  do {
+    bp->next = (uint32_t)old;
+    new = ((old >> 32) + 1) << 32 | OFF(bp);
+  } while (!__atomic_compare_exchange_n(&ar->quick_head[i], &old, new, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  __atomic_add_fetch(&ar->quick_len[i], 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+//
+// quick_flush - Free and coalesce every block on the quick stacks,
+//               returns how many there were. Each stack is emptied by
+//               one CAS, after which its blocks belong to the caller
+//               alone; the caller holds the lock.
+//
+static int quick_flush(void)
+{
+  int i, k, n = 0;
+
+  for (i = 0; i < QUICK_CLASSES; i++) {
+    uint64_t old = __atomic_load_n(&ar->quick_head[i], __ATOMIC_ACQUIRE);
+    uint32_t off;
+
+    do {
+      if ((uint32_t)old == 0)
+        break;
+    } while (!__atomic_compare_exchange_n(&ar->quick_head[i], &old,
+                                          ((old >> 32) + 1) << 32, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    for (off = (uint32_t)old, k = 0; off != 0; k++) {
+      blockHdr *bp = PTR(off);
+      off = bp->next;
+      blk_free(bp);
+    }
+    __atomic_sub_fetch(&ar->quick_len[i], k, __ATOMIC_RELAXED);
+    n += k;
+  }
+  return n;
+}
+#else
+static void quick_reset(void)
+{
+  memset(ar->quick_head, 0, sizeof(ar->quick_head));
+  memset(ar->quick_len, 0, sizeof(ar->quick_len));
+  memset(ar->quick_map, 0, sizeof(ar->quick_map));
+}
+
+static inline blockHdr *quick_pop(size_t size)
+{
+  int i = quick_class(size);
+  blockHdr *bp;
+
+  if (ar->quick_head[i] == 0)
+    return NULL;
+  bp = PTR(ar->quick_head[i]);
+  ar->quick_head[i] = bp->next;
+  if (--ar->quick_len[i] == 0)
+    ar->quick_map[i / 64] &= ~(1ull << (i % 64));
+  return bp;
+}
+
+static inline int quick_push(blockHdr *bp)
+{
+  int i = quick_class(BLK_SIZE(bp));
+
+  bp->next = ar->quick_head[i];
+  ar->quick_head[i] = OFF(bp);
+  ar->quick_map[i / 64] |= 1ull << (i % 64);
+  if (++ar->quick_len[i] > QUICK_LEN)
+    quick_flush();
+  return 1;
+}
+
+//
+// quick_flush - Free and coalesce every block on the quick lists,
+//               returns how many there were
+//
+static int quick_flush(void)
+{
+  int w, i, n = 0;
+
+  for (w = 0; w < (QUICK_CLASSES + 63) / 64; w++)
+    while (ar->quick_map[w] != 0) {
+      i = w * 64 + __builtin_ctzll(ar->quick_map[w]);
+      ar->quick_map[w] &= ar->quick_map[w] - 1;
+      while (ar->quick_head[i] != 0) {
+        blockHdr *bp = PTR(ar->quick_head[i]);
+        ar->quick_head[i] = bp->next;
+        blk_free(bp);
+      }
+      n += ar->quick_len[i];
+      ar->quick_len[i] = 0;
+    }
+  return n;
+}
+#endif
+#endif
+
+#if MMAP_MIN
+/////////////////////////////////////////////////////////////////////////////
+//
+// Mapped large objects
+//
+// The payload starts a doubleword into the mapping, and the word in
+// front of it holds the length of the mapping. Nothing in the heap
+// refers to them; anything outside the arenas' segments is one of
+// these, which can be told without reading a brk.
+//
+static inline int is_mapped(void *ptr) {
+  return (size_t)((char *)ptr - arenas[0].heap_base) >= mem_maxheap() * MM_ARENAS;
+}
+
+static inline uint32_t MAP_SIZE(void *ptr) {
+  return GET((char *)ptr - WSIZE);
+}
+
+static void *map_alloc(uint32_t size)
+{
+  size_t len = (size + DSIZE + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+  char *p = mem_map(len);
+
+  if (p == NULL)
+    return NULL;
+  PUT(p + WSIZE, len);
+  return p + DSIZE;
+}
+
+static void map_free(void *ptr)
+{
+  mem_unmap((char *)ptr - DSIZE, MAP_SIZE(ptr));
+}
+
+// Resize a mapped object by moving its pages, never its bytes
+static void *map_resize(void *ptr, uint32_t size)
+{
+  size_t len = (size + DSIZE + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+  char *p;
+
+  if (len == MAP_SIZE(ptr))
+    return ptr;
+  if ((p = mem_remap((char *)ptr - DSIZE, MAP_SIZE(ptr), len)) == NULL)
+    return NULL;
+  PUT(p + WSIZE, len);
+  return p + DSIZE;
+}
+#endif
+
+//
+// heap_malloc - Allocate a block with at least size bytes of payload
+//
+static void *heap_malloc(uint32_t size)
+{
+  // new block size is header + requested size, but large enough to
+  // hold the free list links and footer once the block is freed
+  size_t newsize = MAX(ALIGN(BLK_HDR_SIZE + size), MIN_BLK_SIZE);
+  blockHdr *bp;
+
+  if (counting())
+    mm_mallocs++;
+#if PURGE_MIN
+  purge_tick();
+#endif
+#if MMAP_MIN
+  // Large objects get pages of their own
+  if (size >= MMAP_MIN)
+    return map_alloc(size);
+#endif
+#if SLAB_MAX
+  // Small objects come from a run
+  if (size <= SLAB_MAX)
+    return run_alloc(size);
+#endif
+#if QUICK_MAX
+  // Reuse a recently freed block of exactly this size
+  if (newsize <= QUICK_MAX && (bp = quick_pop(newsize)) != NULL)
+    return (char *)bp + BLK_HDR_SIZE;
+#endif
+#if FINE_LOCKS
+  if ((bp = fine_alloc(newsize)) == NULL)
+    return NULL;
+#else
+  // Space unavailable
+  if ((bp = get_free(newsize)) == NULL)
+    return NULL;
+  bp = place(bp, newsize);
+#endif
+  // Return pointer to the payload
+  return (char *)bp + BLK_HDR_SIZE;
+}
+
+#if !FINE_LOCKS
+//
+// get_free - Find a free block of at least asize bytes. When the free
+//            lists have none it comes from the wilderness, growing that
+//            first if it is too small. The block is left on its list.
+//
+static blockHdr *get_free(size_t asize)
+{
+  // Call find_fit to request existing block of asize
+  blockHdr *bp = find_fit(asize);
+
+#if QUICK_MAX
+  // Merge the quick lists into the free lists and look again
+  if (bp == NULL && quick_flush())
+    bp = find_fit(asize);
+#endif
+  if (bp == NULL) {
+    if (ar->wild != NULL && BLK_SIZE(ar->wild) >= asize)
+      bp = ar->wild;
+    else
+      bp = grow_wild(asize - (ar->wild ? BLK_SIZE(ar->wild) : 0));
+  }
+  return bp;
+}
+
+//
+// place - Allocate asize bytes at the start of free block bp, or at
+//         its end for requests of at least split_high bytes, split off
+//         the remainder if it would be a usable block and return the
+//         allocated block
+//
+static blockHdr *place(blockHdr *bp, uint32_t asize)
+{
+  size_t csize = BLK_SIZE(bp);
+  int high = split_high && asize >= split_high;
+  blockHdr *ab;
+
+  // Remove bp from free list
+  remove_free(bp);
+  if (high && csize - asize >= FOVERHEAD) {
+    // Allocate the top asize bytes, whose predecessor stays free
+    ab = (blockHdr *)((char *)bp + csize - asize);
+    ab->size = PACK(asize, 1);
+    SET_PREV_ALLOC(NEXT_BLKP(ab), 1);
+    // The rest keeps bp's header and goes back on a list
+    SET_HDR(bp, csize - asize, 0);
+    SET_FTR(bp);
+    insert_free(bp);
+    return ab;
+  }
+  if (csize - asize >= FOVERHEAD) {
+    // Shrink bp to asize and allocate
+    SET_HDR(bp, asize, 1);
+    // Setup new block, whose predecessor is now allocated
+    ab = NEXT_BLKP(bp);
+    ab->size = PACK(csize - asize, 0) | PREV_ALLOC;
+    SET_FTR(ab);
+    // Push new block onto the free list for its size class
+    insert_free(ab);
+  }
+  else {
+    // Mark as allocated
+    SET_HDR(bp, csize, 1);
+    SET_PREV_ALLOC(NEXT_BLKP(bp), 1);
+  }
+  return bp;
+}
+
+//
+// find_fit - Find a fit for a block with asize bytes
+//
+#if TLSF
+static void *find_fit(uint32_t asize)
+{
+  int fl, sl, i;
+  uint32_t map;
+  // Round the request up to the next bin boundary, so that every block
+  // in the bin we land on is large enough and the head can be taken
+  if (asize < SMALL_LIMIT)
+    asize += 15;
+  else
+    asize += (1u << (31 - __builtin_clz(asize) - SL_BITS)) - 1;
+  i = bin_index(asize);
+  fl = i / SL_COUNT;
+  sl = i % SL_COUNT;
+  // Any non-empty bin at or above sl on this first level?
+  map = ar->sl_bitmap[fl] & (~0u << sl);
+  if (map == 0) {
+    // No, take the smallest non-empty first level above this one
+    map = (fl + 1 < 32) ? ar->fl_bitmap & (~0u << (fl + 1)) : 0;
+    if (map == 0)
+      return NULL;
+    fl = __builtin_ctz(map);
+    map = ar->sl_bitmap[fl];
+  }
+  sl = __builtin_ctz(map);
+  return NEXT_FREE(BIN(fl * SL_COUNT + sl));
+}
+#else
+static void *find_fit(uint32_t asize)
+{
+  blockHdr *bp;
+  int i;
+#if TREE_MIN
+  // Large requests go straight to the tree for a best fit
+  if (asize >= TREE_MIN)
+    return tree_best_fit(asize);
+#endif
+  // Start at the request's size class and move up to larger ones.
+  // Every block in a later bin is larger than any in this one, so the
+  // first bin with a fit has the best one.
+  for (i = bin_index(asize); i < NBINS; i++) {
+    blockHdr *start = BIN(i), *best = NULL;
+    int fits = 0;
+    if (fit_mode == FIT_NEXT && ar->rover != NULL && ar->rover_bin == i)
+      start = ar->rover;
+    bp = start;
+    do {
+      if (bp != BIN(i)) {
+        if (counting())
+          mm_scanned++;
+        if (BLK_SIZE(bp) >= asize) {
+          if (fit_mode != FIT_GOOD) {
+            ar->rover = bp;
+            ar->rover_bin = i;
+            return bp;
+          }
+          if (best == NULL || BLK_SIZE(bp) < BLK_SIZE(best))
+            best = bp;
+          if (BLK_SIZE(best) == asize || ++fits == fit_k)
+            break;
+        }
+      }
+      bp = NEXT_FREE(bp);
+    } while (bp != start);
+    if (best != NULL)
+      return best;
+  }
+#if TREE_MIN
+  // Nothing on the lists, so take the smallest large block
+  return tree_best_fit(asize);
+#endif
+  // There is no appropriate block on the free list
+  // calling function must initialize new block
+  return NULL;
+}
+#endif
+#endif
+
+//
+// heap_free - Free a block
+//
+// ptr is a pointer to the payload of the block we want to free
+static void heap_free(void *ptr)
+{
+#if PURGE_MIN
+  purge_tick();
+#endif
+#if MMAP_MIN
+  if (is_mapped(ptr)) {
+    map_free(ptr);
+    return;
+  }
+#endif
+#if SLAB_MAX
+  if (is_run_obj(ptr)) {
+    run_free(ptr);
+    return;
+  }
+#endif
+#if QUICK_MAX
+  if (BLK_SIZE(ptr-BLK_HDR_SIZE) <= QUICK_MAX && quick_push(ptr-BLK_HDR_SIZE))
+    return;
+#endif
+#if FINE_LOCKS
+  fine_free(ptr-BLK_HDR_SIZE);
+#else
+  blk_free(ptr-BLK_HDR_SIZE);
+#endif
+}
+
+#if !FINE_LOCKS
+//
+// blk_free - Return allocated block bp to the free lists
+//
+static void blk_free(blockHdr *bp)
+{
+  // Mark as unallocated, which gives it a footer again
+  SET_HDR(bp, BLK_SIZE(bp), 0);
+  SET_FTR(bp);
+  SET_PREV_ALLOC(NEXT_BLKP(bp), 0);
+  // Coalesce will join adjacent free blocks and add to the free list
+  bp = coalesce(bp);
+#if TRIM_MIN
+  if (bp == ar->wild)
+    trim_wild();
+#endif
+}
+#endif
+
+//
+// split_blk - Shrink allocated block bp to newsize bytes and free the
+//             remainder, if the remainder is worth a block of its own
+//
+static void split_blk(blockHdr *bp, size_t newsize)
+{
+  blockHdr *tail;
+  size_t csize = BLK_SIZE(bp);
+
+  if (csize < newsize + FOVERHEAD)
+    return;
+  SET_HDR(bp, newsize, 1);
+  tail = NEXT_BLKP(bp);
+#if FINE_LOCKS
+  // Freed like any other block, under its neighbours' locks
+  PUT_HDR(tail, PACK(csize - newsize, 1) | PREV_ALLOC);
+  fine_free(tail);
+  return;
+#endif
+  PUT_HDR(tail, PACK(csize - newsize, 0) | PREV_ALLOC);
+  SET_FTR(tail);
+  SET_PREV_ALLOC(NEXT_BLKP(tail), 0);
+#if TRIM_MIN
+  if (coalesce(tail) == ar->wild)
+    trim_wild();
+#else
+  coalesce(tail);
+#endif
+}
+
+#if FINE_LOCKS
+/////////////////////////////////////////////////////////////////////////////
+//
+// Fine-grained locks
+//
+// A free block is on list i, or is the wilderness, exactly while its
+// header says it is free and its successor's prev-allocated bit is
+// clear, and both only change under lock i (bin_index of its size) or
+// the growth lock. The lists are LIFO first fit, so each list's state
+// is its sentinel and the blocks on it. A free block is the wilderness
+// if the header after it is the epilogue's, which holds at every step
+// since the epilogue is always written before a header that reaches it.
+//
+#define GROW_LOCK   NBINS
+
+// Take lock i, counting the times another thread had it
+static inline void fine_lock(int i)
+{
+  pthread_mutex_t *m = &ar->bin_lock[i].m;
+
+  if (pthread_mutex_trylock(m) != 0) {
+    __atomic_fetch_add(i == GROW_LOCK ? &mm_grow_waits : &mm_lock_waits, 1,
+                       __ATOMIC_RELAXED);
+    pthread_mutex_lock(m);
+  }
+}
+
+static inline void fine_unlock(int i)
+{
+  pthread_mutex_unlock(&ar->bin_lock[i].m);
+}
+
+// Reads of the previous block's footer and bp's header, which sit a
+// word below a doubleword boundary and so are one aligned doubleword
+// (footer in the low word), and of a header further on. Unlocked, either
+// may be in another thread's payload by now, but fine_free checks what
+// it read once it has the locks, so the race is benign and hidden from
+// TSan.
+__attribute__((no_sanitize_thread))
+static uint64_t peek_pair(blockHdr *bp) {
+  return *(volatile uint64_t *)((char *)bp - BLK_FTR_SIZE);
+}
+
+__attribute__((no_sanitize_thread))
+static uint32_t peek_hdr(blockHdr *bp) {
+  return *(volatile uint32_t *)bp;
+}
+
+// Add free block bp to its list, or take it off, under the list's lock
+static inline void fine_insert(blockHdr *bp)
+{
+  int i = bin_index(BLK_SIZE(bp));
+
+  push(BIN(i), bp);
+  __atomic_or_fetch(&ar->bin_map, 1u << i, __ATOMIC_RELAXED);
+}
+
+static inline void fine_remove(blockHdr *bp)
+{
+  int i = bin_index(BLK_SIZE(bp));
+
+  pop(bp);
+  if (NEXT_FREE(BIN(i)) == BIN(i))
+    __atomic_and_fetch(&ar->bin_map, ~(1u << i), __ATOMIC_RELAXED);
+}
+
+//
+// wild_alloc - Carve asize bytes from the front of the wilderness under
+//              the growth lock, growing it first if it is too small
+//
+static blockHdr *wild_alloc(size_t asize)
+{
+  blockHdr *bp, *rest;
+  size_t wsize;
+
+  fine_lock(GROW_LOCK);
+  bp = ar->wild;
+  if (bp == NULL || BLK_SIZE(bp) < asize)
+    bp = grow_wild(asize - (bp ? BLK_SIZE(bp) : 0));
+  if (bp != NULL) {
+    wsize = BLK_SIZE(bp);
+    ar->wild = NULL;
+    if (wsize - asize >= FOVERHEAD) {
+      // The rest stays the wilderness, the epilogue's bit stays clear
+      SET_HDR(bp, asize, 1);
+      rest = NEXT_BLKP(bp);
+      PUT_HDR(rest, PACK(wsize - asize, 0) | PREV_ALLOC);
+      SET_FTR(rest);
+      ar->wild = rest;
+    }
+    else {
+      SET_HDR(bp, wsize, 1);
+      SET_PREV_ALLOC(NEXT_BLKP(bp), 1);
+    }
+  }
+  fine_unlock(GROW_LOCK);
+  return bp;
+}
+
+//
+// fine_alloc - Take the first block of at least asize bytes from the
+//              lists, holding one list's lock at a time, or carve one
+//              from the wilderness. A list block's excess is freed once
+//              the lock is dropped.
+//
+static blockHdr *fine_alloc(size_t asize)
+{
+  blockHdr *bp = NULL;
+  int i;
+
+  for (i = bin_index(asize); i < NBINS && bp == NULL; i++) {
+    // An empty list is passed over unlocked; a block pushed on it
+    // meanwhile is only missed by this search
+    if (!(__atomic_load_n(&ar->bin_map, __ATOMIC_RELAXED) & (1u << i)))
+      continue;
+    fine_lock(i);
+    for (bp = NEXT_FREE(BIN(i)); bp != BIN(i); bp = NEXT_FREE(bp))
+      if (BLK_SIZE(bp) >= asize)
+        break;
+    if (bp != BIN(i)) {
+      fine_remove(bp);
+      SET_HDR(bp, BLK_SIZE(bp), 1);
+      SET_PREV_ALLOC(NEXT_BLKP(bp), 1);
+    }
+    else
+      bp = NULL;
+    fine_unlock(i);
+  }
+  if (bp == NULL)
+    return wild_alloc(asize);
+  split_blk(bp, asize);
+  return bp;
+}
+
+//
+// fine_grow - Grow allocated block bp in place to at least asize bytes
+//             by absorbing its successor, under that block's lock. The
+//             wilderness, or the end of the heap, is grown first if need
+//             be. Returns 0, leaving bp alone, if the successor is in use,
+//             too small or changed before its lock was taken.
+//
+static int fine_grow(blockHdr *bp, size_t asize)
+{
+  blockHdr *nextb = NEXT_BLKP(bp);
+  uint32_t nhdr = HDR_WORD(nextb);
+  size_t size = BLK_SIZE(bp);
+  int i, nwild;
+
+  if ((nhdr & 0x1) && (nhdr & ~0x7) != 0)
+    return 0;
+  nwild = !(nhdr & 0x1) &&
+          (peek_hdr((blockHdr *)((char *)nextb + (nhdr & ~0x7))) & ~0x7) == 0;
+  i = (nhdr & 0x1) || nwild ? GROW_LOCK : bin_index(nhdr & ~0x7);
+  fine_lock(i);
+  if (HDR_WORD(nextb) != nhdr ||
+      (!(nhdr & 0x1) && nwild != (BLK_SIZE(NEXT_BLKP(nextb)) == 0))) {
+    fine_unlock(i);
+    return 0;
+  }
+  if (i == GROW_LOCK) {
+    // nextb is the wilderness or the epilogue, which grow_wild turns
+    // into the wilderness
+    if (size + (nwild ? BLK_SIZE(nextb) : 0) < asize &&
+        grow_wild(asize - size - (nwild ? BLK_SIZE(nextb) : 0)) == NULL) {
+      fine_unlock(i);
+      return 0;
+    }
+    nextb = ar->wild;
+    ar->wild = NULL;
+  }
+  else if (size + BLK_SIZE(nextb) < asize) {
+    fine_unlock(i);
+    return 0;
+  }
+  else
+    fine_remove(nextb);
+  SET_HDR(bp, size + BLK_SIZE(nextb), 1);
+  SET_PREV_ALLOC(NEXT_BLKP(bp), 1);
+  fine_unlock(i);
+  split_blk(bp, asize);
+  return 1;
+}
+
+//
+// fine_free - Free allocated block bp, merging it with free neighbours
+//
+// The neighbours are read without locks, which gives the set of locks
+// the merge needs: those of the lists the neighbours are on and of the
+// list the merged block goes to (the growth lock for the wilderness).
+// They are taken in index order, and if the neighbours changed in the
+// meantime they are dropped and the whole thing is tried again.
+//
+// Two neighbours freed at the same moment, under disjoint locks, can
+// each see the other still allocated. Both write the later block's
+// header, one to claim it and the other to clear its prev-allocated
+// bit, so whichever writes second sees the other free. A claim that
+// fails is retried; a clear that finds its successor free takes the
+// merged block back off its list and frees it again.
+//
+static void fine_free(blockHdr *bp)
+{
+  blockHdr *prevb, *nextb, *mb;
+  uint64_t pair;
+  uint32_t hdr, ftr, nhdr, old;
+  size_t size, total;
+  int locks[3], n, i, j, pfree, nfree, nwild, last;
+
+  for (;;) {
+    pair = peek_pair(bp);
+    hdr = (uint32_t)(pair >> 32);
+    ftr = (uint32_t)pair & ~0x7;
+    size = hdr & ~0x7;
+    pfree = !(hdr & PREV_ALLOC);
+    prevb = (blockHdr *)((char *)bp - ftr);
+    nextb = (blockHdr *)((char *)bp + size);
+    nhdr = HDR_WORD(nextb);
+    nfree = !(nhdr & 0x1);
+    nwild = nfree && (peek_hdr((blockHdr *)((char *)nextb + (nhdr & ~0x7))) & ~0x7) == 0;
+    last = nfree ? nwild : (nhdr & ~0x7) == 0;
+    total = size + (pfree ? ftr : 0) + (nfree ? nhdr & ~0x7 : 0);
+
+    // Lock the merged block's list and the neighbours', in order
+    n = 0;
+    locks[n++] = last ? GROW_LOCK : bin_index(total);
+    if (pfree)
+      locks[n++] = bin_index(ftr);
+    if (nfree)
+      locks[n++] = nwild ? GROW_LOCK : bin_index(nhdr & ~0x7);
+    for (i = 1; i < n; i++)
+      for (j = i; j > 0 && locks[j - 1] > locks[j]; j--) {
+        int t = locks[j];
+        locks[j] = locks[j - 1];
+        locks[j - 1] = t;
+      }
+    for (i = 0; i < n; i++)
+      if (i == 0 || locks[i] != locks[i - 1])
+        fine_lock(locks[i]);
+
+    // Still the same neighbours? If bp's predecessor was allocated,
+    // claiming bp's header (with its new size) is the check
+    if ((pfree ? peek_pair(bp) == pair : 1) && HDR_WORD(nextb) == nhdr &&
+        (!nfree || nwild == (BLK_SIZE(NEXT_BLKP(nextb)) == 0)) &&
+        (pfree || __atomic_compare_exchange_n(&bp->size, &hdr,
+                                              PACK(total, 0) | PREV_ALLOC, 0,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED)))
+      break;
+    for (i = n - 1; i >= 0; i--)
+      if (i == 0 || locks[i] != locks[i - 1])
+        fine_unlock(locks[i]);
+  }
+
+  mb = pfree ? prevb : bp;
+  if (pfree)
+    fine_remove(prevb);
+  if (nfree && nwild)
+    ar->wild = NULL;
+  else if (nfree)
+    fine_remove(nextb);
+  if (pfree)
+    SET_HDR(mb, total, 0);
+  SET_FTR(mb);
+  if (last)
+    ar->wild = mb;
+  else
+    fine_insert(mb);
+  old = __atomic_fetch_and(&NEXT_BLKP(mb)->size, ~PREV_ALLOC, __ATOMIC_RELEASE);
+#if TRIM_MIN
+  if (last)
+    trim_wild();
+#endif
+  for (i = n - 1; i >= 0; i--)
+    if (i == 0 || locks[i] != locks[i - 1])
+      fine_unlock(locks[i]);
+
+  // The successor was freed meanwhile without merging with mb. If mb
+  // is still on its list (its header may be a stale one inside a larger
+  // block by now), take it off again and free it again.
+  if (!(old & 0x1)) {
+    i = bin_index(total);
+    fine_lock(i);
+    for (nextb = NEXT_FREE(BIN(i)); nextb != BIN(i); nextb = NEXT_FREE(nextb))
+      if (nextb == mb)
+        break;
+    if (nextb != mb) {
+      fine_unlock(i);
+      return;
+    }
+    fine_remove(mb);
+    SET_HDR(mb, BLK_SIZE(mb), 1);
+    SET_PREV_ALLOC(NEXT_BLKP(mb), 1);
+    fine_unlock(i);
+    fine_free(mb);
+  }
+}
+#endif
+
+#if SLAB_MAX
+/////////////////////////////////////////////////////////////////////////////
+//
+// Slab runs for small objects
+//
+// Each run is a RUN_SIZE page holding one size class. Its header keeps
+// a bitmap of free slots, and runs with at least one free slot are on
+// a doubly linked list per class. run_map has a bit per heap page that
+// is set while that page is a run, which is how mm_free tells run
+// objects from boundary-tag payloads.
+//
+typedef struct run runHdr;
+
+struct run {
+  // Heap offsets of the neighbouring runs with free slots in this class
+  uint32_t next;
+  uint32_t prev;
+  uint16_t osize;                   // object size
+  uint16_t nobj;                    // objects in the run
+  uint16_t nfree;                   // free objects in the run
+  uint16_t cls;                     // size class
+  uint64_t map[RUN_MAPWORDS];       // bit set iff that slot is free
+};
+
+#define RUN_OBJS    ALIGN(sizeof(runHdr))               // first object
+#define RUN_BLK_SIZE ALIGN(BLK_HDR_SIZE + RUN_SIZE)     // block holding a run
+
+// Index of the RUN_SIZE page holding p, counting from heap_base's page
+static inline uint32_t PAGE(void *p) {
+  return (uintptr_t)p / RUN_SIZE - (uintptr_t)ar->heap_base / RUN_SIZE;
+}
+
+static inline runHdr *RUN(uint32_t off) {
+  return off ? PTR(off) : NULL;
+}
+
+// Runs come and go under the heap lock, but thread caches look pages
+// up without it, so with MM_THREADS the map's words change atomically
+static inline void run_mark(uint32_t pg, int on)
+{
+#if MM_THREADS
+  if (on)
+    __atomic_or_fetch(&ar->run_map[pg / 32], 1u << (pg % 32), __ATOMIC_RELAXED);
+  else
+    __atomic_and_fetch(&ar->run_map[pg / 32], ~(1u << (pg % 32)), __ATOMIC_RELAXED);
+#else
+  if (on)
+    ar->run_map[pg / 32] |= 1u << (pg % 32);
+  else
+    ar->run_map[pg / 32] &= ~(1u << (pg % 32));
+#endif
+}
+
+static inline int is_run_obj(void *ptr)
+{
+  uint32_t pg = PAGE(ptr);
+  return (__atomic_load_n(&ar->run_map[pg / 32], __ATOMIC_RELAXED) >> (pg % 32)) & 1;
+}
+
+static inline runHdr *run_of(void *ptr) {
+  return (runHdr *)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1));
+}
+
+static size_t run_obj_size(void *ptr) {
+  return run_of(ptr)->osize;
+}
+
+// Forget every run, the heap they lived in has been reset
+static void run_reset(void)
+{
+  memset(ar->run_map, 0, (ar->run_map_hi / 32 + 1) * sizeof(uint32_t));
+  memset(ar->run_avail, 0, sizeof(ar->run_avail));
+  ar->run_map_hi = 0;
+}
+
+static void run_link(runHdr *r)
+{
+  r->prev = 0;
+  r->next = ar->run_avail[r->cls];
+  if (r->next)
+    RUN(r->next)->prev = OFF(r);
+  ar->run_avail[r->cls] = OFF(r);
+}
+
+static void run_unlink(runHdr *r)
+{
+  if (r->prev)
+    RUN(r->prev)->next = r->next;
+  else
+    ar->run_avail[r->cls] = r->next;
+  if (r->next)
+    RUN(r->next)->prev = r->prev;
+}
+
+//
+// run_new - Carve a block whose payload is a RUN_SIZE aligned page out
+//           of a free block large enough for any alignment, and set it
+//           up as an empty run of class cls
+//
+static runHdr *run_new(int cls)
+{
+  size_t need = RUN_BLK_SIZE + RUN_SIZE + MIN_BLK_SIZE;
+  blockHdr *bp = get_free(need), *rb;
+  char *page;
+  size_t gap, csize;
+  runHdr *r;
+  int i;
+
+  if (bp == NULL)
+    return NULL;
+  remove_free(bp);
+  csize = BLK_SIZE(bp);
+  // Leave room for a free block in front unless we are already aligned
+  page = (char *)(((uintptr_t)bp + BLK_HDR_SIZE + RUN_SIZE - 1) &
+                  ~(uintptr_t)(RUN_SIZE - 1));
+  gap = page - BLK_HDR_SIZE - (char *)bp;
+  if (gap != 0 && gap < MIN_BLK_SIZE) {
+    page += RUN_SIZE;
+    gap += RUN_SIZE;
+  }
+  rb = (blockHdr *)(page - BLK_HDR_SIZE);
+  if (gap != 0) {
+    rb->size = PACK(csize - gap, 1);
+    SET_HDR(bp, gap, 0);
+    SET_FTR(bp);
+    insert_free(bp);
+  }
+  else
+    SET_HDR(rb, csize, 1);
+  SET_PREV_ALLOC(NEXT_BLKP(rb), 1);
+  split_blk(rb, RUN_BLK_SIZE);
+
+  r = (runHdr *)page;
+  r->cls = cls;
+  r->osize = (cls + 1) * 8;
+  r->nobj = MIN((RUN_SIZE - RUN_OBJS) / r->osize, RUN_MAPWORDS * 64);
+  r->nfree = r->nobj;
+  memset(r->map, 0, sizeof(r->map));
+  for (i = 0; i < r->nobj; i++)
+    r->map[i / 64] |= 1ull << (i % 64);
+  run_mark(PAGE(r), 1);
+  ar->run_map_hi = MAX(ar->run_map_hi, PAGE(r));
+  run_link(r);
+  return r;
+}
+
+//
+// run_alloc - Take the first free slot of a run in size's class
+//
+static void *run_alloc(uint32_t size)
+{
+  int cls = (MAX(size, 1) + 7) / 8 - 1, w;
+  runHdr *r = RUN(ar->run_avail[cls]);
+
+  if (r == NULL && (r = run_new(cls)) == NULL)
+    return NULL;
+  for (w = 0; r->map[w] == 0; w++)
+    ;
+  int slot = w * 64 + __builtin_ctzll(r->map[w]);
+  r->map[w] &= r->map[w] - 1;
+  // Full runs leave the list until something in them is freed
+  if (--r->nfree == 0)
+    run_unlink(r);
+  return (char *)r + RUN_OBJS + slot * r->osize;
+}
+
+//
+// run_free - Mark ptr's slot free. An empty run goes back to the heap
+//            unless it is the only run its class has room in.
+//
+static void run_free(void *ptr)
+{
+  runHdr *r = run_of(ptr);
+  int slot = ((char *)ptr - ((char *)r + RUN_OBJS)) / r->osize;
+
+  r->map[slot / 64] |= 1ull << (slot % 64);
+  if (r->nfree++ == 0)
+    run_link(r);
+  if (r->nfree == r->nobj && (r->next != 0 || r->prev != 0)) {
+    run_unlink(r);
+    run_mark(PAGE(r), 0);
+    blk_free((blockHdr *)((char *)r - BLK_HDR_SIZE));
+  }
+}
+#endif
+
+//
+// heap_realloc - Resize in place where the neighbouring memory allows it,
+//                otherwise allocate a new block and copy
+//
+static void *heap_realloc(void *ptr, uint32_t size)
+{
+  if (ptr == NULL)
+    return heap_malloc(size);
+  if (size == 0) {
+    heap_free(ptr);
+    return NULL;
+  }
+
+#if MMAP_MIN
+  // Mapped objects that stay large are remapped to their new number of
+  // pages, small ones move back into the heap
+  if (is_mapped(ptr)) {
+    size_t avail = MAP_SIZE(ptr) - DSIZE;
+    void *newptr;
+    if (size >= MMAP_MIN)
+      return map_resize(ptr, size);
+    if ((newptr = heap_malloc(size)) == NULL)
+      return NULL;
+    memcpy(newptr, ptr, MIN(size, avail));
+    map_free(ptr);
+    return newptr;
+  }
+#endif
+#if SLAB_MAX
+  // Objects in runs stay put while they fit their class, otherwise
+  // they move like any other copy
+  if (is_run_obj(ptr)) {
+    size_t osize = run_obj_size(ptr);
+    void *newptr;
+    if (size <= osize && osize - size < 8)
+      return ptr;
+    if ((newptr = heap_malloc(size)) == NULL)
+      return NULL;
+    memcpy(newptr, ptr, MIN(size, osize));
+    run_free(ptr);
+    return newptr;
+  }
+#endif
+
+  blockHdr *bp = ptr-BLK_HDR_SIZE;
+  size_t oldsize = BLK_SIZE(bp);
+  size_t newsize = MAX(ALIGN(BLK_HDR_SIZE + size), MIN_BLK_SIZE);
+
+  // Shrinking (or already large enough): keep the payload where it is
+  // and free the excess, which coalesces with a free right neighbour
+  if (newsize <= oldsize) {
+    split_blk(bp, newsize);
+    return ptr;
+  }
+
+#if !FINE_LOCKS
+  blockHdr *nextb = NEXT_BLKP(bp);
+  size_t avail = oldsize;
+
+  // Space a free successor would add
+  if (!IS_ALLOC(nextb))
+    avail += BLK_SIZE(nextb);
+
+  // We (or the wilderness after us) end the heap, so grow the
+  // wilderness until it can be absorbed
+  if (avail < newsize && (BLK_SIZE(nextb) == 0 || nextb == ar->wild)) {
+    if ((nextb = grow_wild(newsize - avail)) == NULL)
+      return NULL;
+    avail = oldsize + BLK_SIZE(nextb);
+  }
+
+  // Absorb the free successor, then give back what we did not need
+  if (avail >= newsize) {
+    remove_free(nextb);
+    extend_blk(bp, BLK_SIZE(nextb));
+    SET_PREV_ALLOC(NEXT_BLKP(bp), 1);
+    split_blk(bp, newsize);
+    return ptr;
+  }
+
+  // Merge with a free predecessor (and any free successor) and slide
+  // the payload down; the regions may overlap, hence memmove
+  if (!GET_PREV_ALLOC(bp)) {
+    blockHdr *prevb = PREV_BLKP(bp);
+    size_t total = avail + BLK_SIZE(prevb);
+    if (total >= newsize) {
+      remove_free(prevb);
+      if (avail != oldsize)
+        remove_free(nextb);
+      SET_HDR(prevb, total, 1);
+      SET_PREV_ALLOC(NEXT_BLKP(prevb), 1);
+      memmove((char *)prevb + BLK_HDR_SIZE, ptr, oldsize - BLK_HDR_SIZE);
+      split_blk(prevb, newsize);
+      return (char *)prevb + BLK_HDR_SIZE;
+    }
+  }
+#else
+  // Only a successor can be absorbed; taking a predecessor would mean
+  // moving the payload under its list's lock
+  if (fine_grow(bp, newsize))
+    return ptr;
+#endif
+
+  // No room around the block, fall back to copying
+  void *newptr = heap_malloc(size);
+  if (newptr == NULL)
+    return NULL;
+  memcpy(newptr, ptr, oldsize - BLK_HDR_SIZE);
+  heap_free(ptr);
+  return newptr;
+}
+
+#if MM_THREADS
+/////////////////////////////////////////////////////////////////////////////
+//
+// Thread caches
+//
+// A cached object is filed under its payload size in 8 byte units,
+// rounded down, and a request looks under its size rounded up, so every
+// object on a list is large enough for every request served from it.
+// Cached objects are still allocated as far as the heap is concerned.
+// mm_init bumps heap_gen, and a thread whose cache was filled from an
+// earlier heap drops it rather than handing out stale pointers.
+//
+#define TC_BINS     (TCACHE_MAX / 8 + 1)
+
+typedef struct tcache {
+  void *head[TC_BINS];          // objects linked through their first word
+  uint8_t len[TC_BINS];
+  unsigned gen;                 // heap_gen when the lists were started
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tc_key;            // flushes a cache when its thread exits
+static pthread_once_t tc_once = PTHREAD_ONCE_INIT;
+
+static void arena_free(void *ptr);
+
+// Give a departing thread's cached objects back to their arenas
+static void tc_exit(void *arg)
+{
+  tcache_t *tc = arg;
+  void *p;
+  int i;
+
+  if (tc->gen == heap_gen)
+    for (i = 0; i < TC_BINS; i++)
+      while ((p = tc->head[i]) != NULL) {
+        tc->head[i] = *(void **)p;
+        arena_free(p);
+      }
+  memset(tc, 0, sizeof(*tc));
+}
+
+static void tc_key_init(void)
+{
+  pthread_key_create(&tc_key, tc_exit);
+}
+
+// Start this thread's lists over if the heap was reset since
+static inline void tc_check(void)
+{
+  if (tcache.gen == heap_gen)
+    return;
+  memset(&tcache, 0, sizeof(tcache));
+  tcache.gen = heap_gen;
+  pthread_once(&tc_once, tc_key_init);
+  pthread_setspecific(tc_key, &tcache);
+}
+
+static inline void *tc_get(uint32_t size)
+{
+  int i = (size + 7) / 8;
+  void *p;
+
+  if (size == 0 || size > TCACHE_MAX)
+    return NULL;
+  tc_check();
+  if ((p = tcache.head[i]) != NULL) {
+    tcache.head[i] = *(void **)p;
+    tcache.len[i]--;
+  }
+  return p;
+}
+
+// Cache ptr if it is small and its list has room, returning 0 if not.
+// ar must be the arena ptr came from.
+static inline int tc_put(void *ptr)
+{
+  size_t cap;
+  int i;
+
+  if (is_mapped(ptr))
+    return 0;
+#if SLAB_MAX
+  if (is_run_obj(ptr))
+    cap = run_obj_size(ptr);
+  else
+#endif
+    cap = (__atomic_load_n((uint32_t *)((char *)ptr - BLK_HDR_SIZE),
+                           __ATOMIC_RELAXED) & ~0x7) - BLK_HDR_SIZE;
+  if (cap > TCACHE_MAX)
+    return 0;
+  i = cap / 8;
+  tc_check();
+  if (tcache.len[i] >= TCACHE_LEN)
+    return 0;
+  *(void **)ptr = tcache.head[i];
+  tcache.head[i] = ptr;
+  tcache.len[i]++;
+  return 1;
+}
+
+#if QUICK_MAX
+// Take a block for size from ar's quick stacks without the lock
+static inline void *quick_get(uint32_t size)
+{
+  size_t asize = MAX(ALIGN(BLK_HDR_SIZE + size), MIN_BLK_SIZE);
+  blockHdr *bp;
+
+  if (size <= SLAB_MAX || asize > QUICK_MAX || (bp = quick_pop(asize)) == NULL)
+    return NULL;
+  return (char *)bp + BLK_HDR_SIZE;
+}
+
+// Push ptr on its arena's quick stack without the lock, returning 0 if
+// it is not a quick block or the stack is full. ar must be its arena.
+static inline int quick_put(void *ptr)
+{
+  blockHdr *bp = (blockHdr *)((char *)ptr - BLK_HDR_SIZE);
+
+  if (is_mapped(ptr))
+    return 0;
+#if SLAB_MAX
+  if (is_run_obj(ptr))
+    return 0;
+#endif
+  if ((__atomic_load_n(&bp->size, __ATOMIC_RELAXED) & ~0x7) > QUICK_MAX)
+    return 0;
+  return quick_push(bp);
+}
+#endif
+
+// Take ar's lock, counting the times another thread had it
+static inline void arena_lock(void)
+{
+  if (pthread_mutex_trylock(&ar->lock) != 0) {
+    __atomic_fetch_add(&mm_lock_waits, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&ar->lock);
+  }
+}
+#endif
+
+// With FINE_LOCKS the heap routines take the locks they need themselves
+#if MM_THREADS && !FINE_LOCKS
+#define LOCK()      arena_lock()
+#define UNLOCK()    pthread_mutex_unlock(&ar->lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// Arenas
+//
+// A block belongs to the arena whose segment holds it. Calls that take
+// a block switch ar to its arena for their duration, so the heap
+// routines only ever see one arena. Mapped objects belong to none and
+// are handled in arena 0.
+//
+static inline arena_t *arena_of(void *ptr)
+{
+#if MM_ARENAS > 1
+  size_t i = (size_t)((char *)ptr - arenas[0].heap_base) / mem_maxheap();
+  return i < MM_ARENAS ? &arenas[i] : &arenas[0];
+#else
+  return &arenas[0];
+#endif
+}
+
+// Make a the arena this thread works in, returning the one it was in
+static inline arena_t *arena_enter(arena_t *a)
+{
+#if MM_ARENAS > 1
+  arena_t *home = ar;
+  ar = a;
+  return home;
+#else
+  return a;
+#endif
+}
+
+#if MM_ARENAS > 1
+//
+// remote_push - Put a block of arena a on its remote stack. Any number
+//               of threads push, but only remote_drain pops and it takes
+//               the whole stack at once, so there is no ABA problem.
+//
+static inline void remote_push(arena_t *a, void *ptr)
+{
+  void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+
+  do
+    *(void **)ptr = head;
+  while (!__atomic_compare_exchange_n(&a->remote, &head, ptr, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//
+// remote_drain - Free every block on ar's remote stack, under ar's lock
+//
+static void remote_drain(void)
+{
+  void *p = __atomic_exchange_n(&ar->remote, NULL, __ATOMIC_ACQUIRE), *next;
+
+  for (; p != NULL; p = next) {
+    next = *(void **)p;
+    heap_free(p);
+  }
+}
+#endif
+
+#if MM_THREADS
+// Free ptr into its own arena, under that arena's lock
+static void arena_free(void *ptr)
+{
+  arena_t *home = arena_enter(arena_of(ptr));
+
+  LOCK();
+  heap_free(ptr);
+  UNLOCK();
+  arena_enter(home);
+}
+#endif
+
+//
+// mm_malloc, mm_free, mm_realloc - The heap routines above, under the
+//                                  arena's lock and behind the thread
+//                                  cache when built with MM_THREADS
+//
+void *mm_malloc(uint32_t size)
+{
+  void *p;
+
+#if MM_THREADS
+  if ((p = tc_get(size)) != NULL)
+    return p;
+#endif
+#if MM_ARENAS > 1
+  if (ar == NULL)
+    ar = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % MM_ARENAS];
+#endif
+#if MM_THREADS && QUICK_MAX
+  if ((p = quick_get(size)) != NULL)
+    return p;
+#endif
+  LOCK();
+#if MM_ARENAS > 1
+  if (ar->heap_base == NULL && arena_init() < 0) {
+    UNLOCK();
+    return NULL;
+  }
+  if (__atomic_load_n(&ar->remote, __ATOMIC_RELAXED) != NULL)
+    remote_drain();
+#endif
+  p = heap_malloc(size);
+  UNLOCK();
+  return p;
+}
+
+void mm_free(void *ptr)
+{
+  arena_t *home = arena_enter(arena_of(ptr));
+
+#if MM_THREADS
+  if (tc_put(ptr)) {
+    arena_enter(home);
+    return;
+  }
+#endif
+#if MM_THREADS && QUICK_MAX
+  if (quick_put(ptr)) {
+    arena_enter(home);
+    return;
+  }
+#endif
+#if MM_ARENAS > 1
+  // Leave another arena's blocks for its own threads
+  if (ar != home && !is_mapped(ptr)) {
+    remote_push(ar, ptr);
+    arena_enter(home);
+    return;
+  }
+#endif
+  LOCK();
+  heap_free(ptr);
+  UNLOCK();
+  arena_enter(home);
+}
+
+void *mm_realloc(void *ptr, uint32_t size)
+{
+  arena_t *home;
+  void *p;
+
+  if (ptr == NULL)
+    return mm_malloc(size);
+  home = arena_enter(arena_of(ptr));
+  LOCK();
+  p = heap_realloc(ptr, size);
+  UNLOCK();
+  arena_enter(home);
+  return p;
+}
+
+//
+// coalesce - boundary tag coalescing. Return ptr to coalesced block
+//
+// bp must already be marked free, with its footer written and the
+// prev-allocated bit of its successor cleared.
+//
+static blockHdr *coalesce(blockHdr *bp)
+{
+  blockHdr *nextb = NEXT_BLKP(bp);
+  size_t size = BLK_SIZE(bp);
+
+  // Case 2/4: next free
+  if (!IS_ALLOC(nextb)) {
+    remove_free(nextb);
+    size += BLK_SIZE(nextb);
+  }
+
+  // Case 3/4: prev free
+  // The merged block changes size class, so it is moved to its new bin
+  if (!GET_PREV_ALLOC(bp)) {
+    bp = PREV_BLKP(bp);
+    remove_free(bp);
+    size += BLK_SIZE(bp);
+  }
+
+  // Case 1 falls through with the block unchanged
+  SET_HDR(bp, size, 0);
+  SET_FTR(bp);
+  insert_free(bp);
+  return bp;
+}
 
 //
 // extend_heap - Extend heap with free block and return its block pointer
@@ -6,6 +6,19 @@ extern void *mm_malloc (uint32_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, uint32_t size);
 
+/* Free blocks examined by the fit search and mm_malloc calls since mm_init */
+extern unsigned long mm_scanned, mm_mallocs;
+
+/* Nonzero if the routines above may be called from several threads at once */
+extern const int mm_thread_safe;
+
+/* Heaps the package keeps, each needing a memlib segment of its own */
+extern const int mm_arenas;
+
+/* Lock acquisitions since mm_init that had to wait, on the heap or list
+   locks and on the heap growth lock (thread safe builds) */
+extern unsigned long mm_lock_waits, mm_grow_waits;
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -0,0 +1,325 @@
+/*
+ * mm_buddy.c - Binary buddy allocator, an alternative engine to mm.c
+ *              ("make mdriver-buddy").
+ *
+ * Every block is 2^k bytes for some order k >= MIN_ORDER and starts at
+ * a multiple of its size from the base of the buddy region, so the
+ * block it was split from and its buddy are found by arithmetic on its
+ * offset. A block starts with a one word header of the form:
+ *
+ *      31                      5  4  3  2  1  0
+ *      -----------------------------------------
+ *     | 0  0  0  ...  0  0  0  k  k  k  k  k  a/f
+ *      -----------------------------------------
+ *
+ * Free blocks of each order are on a doubly linked list whose links are
+ * 32-bit heap offsets in the payload. For every order there is also a
+ * bitmap with one bit per buddy pair, holding the XOR of the two buddies'
+ * free states, so freeing a block learns whether its buddy is free from
+ * one bit flip and never reads a neighbour. The heap has the form:
+ *
+ * begin                                                          end
+ * heap                                                           heap
+ *  -----------------------------------------------------------------
+ * | pad |               one block of order top                      |
+ *  -----------------------------------------------------------------
+ *       | buddy region, grown by doubling                           |
+ *
+ * The pad word puts every header 4 bytes before a doubleword boundary,
+ * so payloads are aligned.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory.h>
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+
+team_t team = {
+  /* Team name */
+  "JLB",
+  /* First member's full name */
+  "Jack Beeken",
+  /* First member's email address */
+  "beekenj@colorado.edu",
+  /* Second member's full name (leave blank if none) */
+  "",
+  /* Second member's email address (leave blank if none) */
+  ""
+};
+
+/////////////////////////////////////////////////////////////////////////////
+// Constants and macros
+//
+#define WSIZE       4
+#define MIN_ORDER   4           // header and two links fit in 16 bytes
+#define INIT_ORDER  12          // the heap starts as one 4 KB block
+#define MAX_ORDER   27          // largest power of two below MAX_HEAP
+
+#if (1 << MAX_ORDER) > MAX_HEAP
+#error "MAX_ORDER does not fit in MAX_HEAP"
+#endif
+
+typedef struct header blockHdr;
+
+struct header {
+  // Order of the block shifted left by one, allocated bit
+  uint32_t info;
+  // Heap offsets of the next and previous free blocks of this order
+  uint32_t next;
+  uint32_t prev;
+};
+
+static char *heap_base;         // mem_heap_lo() when mm_init ran
+static char *region;            // first block of the buddy region
+static int top;                 // order of the whole region
+
+// mm_malloc calls since mm_init; there are no lists to scan, the free
+// list of the right order is found from free_orders
+unsigned long mm_scanned, mm_mallocs;
+
+// Not thread safe, "mdriver -T" needs mdriver-mt
+const int mm_thread_safe = 0;
+
+// One heap, in memlib's first segment
+const int mm_arenas = 1;
+
+// No locks to wait for
+unsigned long mm_lock_waits, mm_grow_waits;
+
+// Free list heads per order, as heap offsets (0 is an empty list) and
+// a bit per order with a non-empty list
+static uint32_t free_area[MAX_ORDER + 1];
+static uint32_t free_orders;
+
+// Buddy pair bitmaps, order k's starts at pair_base(k)
+static uint64_t pair_map[((1u << (MAX_ORDER - MIN_ORDER)) + 63) / 64];
+
+/////////////////////////////////////////////////////////////////////////////
+// Helper functions
+//
+static inline uint32_t OFF(void *bp) {
+  return (uint32_t)((char *)bp - heap_base);
+}
+
+static inline blockHdr *PTR(uint32_t off) {
+  return (blockHdr *)(heap_base + off);
+}
+
+static inline int ORDER(blockHdr *bp) {
+  return bp->info >> 1;
+}
+
+static inline int IS_ALLOC(blockHdr *bp) {
+  return bp->info & 1;
+}
+
+static inline void SET_HDR(blockHdr *bp, int order, int alloc) {
+  bp->info = (uint32_t)order << 1 | alloc;
+}
+
+static inline blockHdr *BUDDY(blockHdr *bp, int order) {
+  return (blockHdr *)(region + (((char *)bp - region) ^ (1u << order)));
+}
+
+// Bits for orders above k come first, order k has 2^(MAX_ORDER-k-1) pairs
+static inline uint32_t pair_base(int order) {
+  return (1u << (MAX_ORDER - MIN_ORDER)) - (1u << (MAX_ORDER - order));
+}
+
+//
+// flip_pair - Toggle the bit for bp's buddy pair at order, returning
+//             its new value: 0 when the two buddies are now both free
+//             (or both in use), 1 when exactly one is free
+//
+static inline int flip_pair(blockHdr *bp, int order)
+{
+  uint32_t i = pair_base(order) + (((char *)bp - region) >> (order + 1));
+  pair_map[i / 64] ^= 1ull << (i % 64);
+  return (pair_map[i / 64] >> (i % 64)) & 1;
+}
+
+static void push(blockHdr *bp, int order)
+{
+  SET_HDR(bp, order, 0);
+  bp->prev = 0;
+  bp->next = free_area[order];
+  if (bp->next)
+    PTR(bp->next)->prev = OFF(bp);
+  free_area[order] = OFF(bp);
+  free_orders |= 1u << order;
+}
+
+static void pop(blockHdr *bp, int order)
+{
+  if (bp->prev)
+    PTR(bp->prev)->next = bp->next;
+  else
+    free_area[order] = bp->next;
+  if (bp->next)
+    PTR(bp->next)->prev = bp->prev;
+  if (free_area[order] == 0)
+    free_orders &= ~(1u << order);
+}
+
+// Smallest order whose blocks hold size payload bytes
+static inline int size_order(uint32_t size)
+{
+  uint32_t need = size + WSIZE;
+  int order = need <= (1u << MIN_ORDER) ? MIN_ORDER :
+              32 - __builtin_clz(need - 1);
+  return order;
+}
+
+//
+// grow - Double the region. The new upper half is the buddy of the whole
+//        old region, so it merges with it if that is a single free block.
+//
+static int grow(void)
+{
+  blockHdr *bp;
+
+  if (top == MAX_ORDER || mem_sbrk(1u << top) == (void *)-1)
+    return -1;
+  bp = (blockHdr *)(region + (1u << top));
+  if (!IS_ALLOC((blockHdr *)region) && ORDER((blockHdr *)region) == top) {
+    pop((blockHdr *)region, top);
+    push((blockHdr *)region, top + 1);
+  }
+  else {
+    flip_pair(bp, top);
+    push(bp, top);
+  }
+  top++;
+  return 0;
+}
+
+//
+// release - Free bp of the given order, merging with its buddy for as
+//           long as the pair bit says the buddy is free too
+//
+static void release(blockHdr *bp, int order)
+{
+  while (order < top && flip_pair(bp, order) == 0) {
+    blockHdr *buddy = BUDDY(bp, order);
+    pop(buddy, order);
+    if (buddy < bp)
+      bp = buddy;
+    order++;
+  }
+  push(bp, order);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+//
+// mm_init - Initialize the memory manager
+//
+int mm_init(void)
+{
+  heap_base = mem_sbrk(WSIZE);
+  if ((long)heap_base == -1)
+    return -1;
+  region = heap_base + WSIZE;
+  if (mem_sbrk(1u << INIT_ORDER) == (void *)-1)
+    return -1;
+  memset(free_area, 0, sizeof(free_area));
+  memset(pair_map, 0, sizeof(pair_map));
+  free_orders = 0;
+  mm_scanned = mm_mallocs = 0;
+  top = INIT_ORDER;
+  push((blockHdr *)region, top);
+  return 0;
+}
+
+//
+// mm_malloc - Take the smallest free block of a large enough order and
+//             split it down, pushing the upper halves on their lists
+//
+void *mm_malloc(uint32_t size)
+{
+  int order = size_order(size), k;
+  blockHdr *bp;
+
+  mm_mallocs++;
+  if (size == 0 || order > MAX_ORDER)
+    return NULL;
+  while ((free_orders >> order) == 0)
+    if (grow() < 0)
+      return NULL;
+  k = __builtin_ctz(free_orders >> order) + order;
+  bp = PTR(free_area[k]);
+  pop(bp, k);
+  if (k < top)
+    flip_pair(bp, k);
+  while (k > order) {
+    k--;
+    flip_pair(bp, k);
+    push((blockHdr *)((char *)bp + (1u << k)), k);
+  }
+  SET_HDR(bp, order, 1);
+  return (char *)bp + WSIZE;
+}
+
+//
+// mm_free - Free a block
+//
+void mm_free(void *ptr)
+{
+  blockHdr *bp = (blockHdr *)((char *)ptr - WSIZE);
+  release(bp, ORDER(bp));
+}
+
+//
+// mm_realloc - Keep the block while it is the right order. Shrinking
+//              gives back upper halves, growing absorbs free right-hand
+//              buddies (doubling the heap when the block is all of it),
+//              and anything else is a copy.
+//
+void *mm_realloc(void *ptr, uint32_t size)
+{
+  blockHdr *bp;
+  int order, k;
+  void *newptr;
+
+  if (ptr == NULL)
+    return mm_malloc(size);
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+  bp = (blockHdr *)((char *)ptr - WSIZE);
+  order = size_order(size);
+  k = ORDER(bp);
+
+  // Shrink, the freed upper halves cannot merge since their buddy is bp
+  while (k > order) {
+    k--;
+    flip_pair(bp, k);
+    push((blockHdr *)((char *)bp + (1u << k)), k);
+  }
+
+  // Grow while bp is a left buddy whose right buddy is free and whole
+  while (k < order && k <= MAX_ORDER) {
+    blockHdr *buddy;
+    if (((char *)bp - region) & (1u << k))
+      break;
+    if (k == top && grow() < 0)
+      break;
+    buddy = (blockHdr *)((char *)bp + (1u << k));
+    if (IS_ALLOC(buddy) || ORDER(buddy) != k)
+      break;
+    pop(buddy, k);
+    flip_pair(bp, k);
+    k++;
+  }
+  SET_HDR(bp, k, 1);
+  if (k >= order)
+    return ptr;
+
+  if ((newptr = mm_malloc(size)) == NULL)
+    return NULL;
+  memcpy(newptr, ptr, (1u << k) - WSIZE);
+  mm_free(ptr);
+  return newptr;
+}